@@ -38,6 +38,16 @@ enum {
 	ENV_NOT_RUNNABLE
 };
 
+// Scheduling priority levels, for sys_env_set_priority.  Lower values
+// are scheduled first.  The scheduler moves CPU-bound environments
+// down from the level they were given towards ENV_PRIO_LOW.
+#define NPRIO			4
+enum {
+	ENV_PRIO_HIGH = 0,
+	ENV_PRIO_NORMAL,
+	ENV_PRIO_LOW = NPRIO - 1
+};
+
 // Special environment types
 enum EnvType {
 	ENV_TYPE_USER = 0,
@@ -55,14 +65,40 @@ struct Env {
 	uint32_t env_runs;		// Number of times environment has run
 	int env_cpunum;			// The CPU that the env is running on
 
+	// Scheduling
+	struct Env *env_rq_next;	// Next env on the same run queue
+	struct Env *env_rq_prev;	// Previous env on the same run queue
+	int env_rq_cpu;			// CPU whose run queue holds us, or -1
+	int env_prio;			// Current priority level
+	int env_prio_base;		// Level we return to after blocking
+	uint32_t env_slice_used;	// Milliseconds of slice used at env_prio
+	int64_t env_vruntime;		// Weighted run time, with SCHED_CFS
+	int env_rq_slot;		// Index in run queue heap, with SCHED_CFS
+	uint32_t env_affinity;		// Bit i set: may run on CPU i
+	bool env_sleeping;		// Env is blocked in sys_sleep_until
+	unsigned int env_wakeup;	// time_msec() to wake up at
+	struct Env *env_sleep_next;	// Next env on the sleep queue
+
+	// Scheduling statistics, in microseconds
+	uint64_t env_runtime;		// Time spent running
+	uint64_t env_wait_start;	// When we last became runnable
+	uint64_t env_max_wait;		// Longest runnable-but-not-running stretch
+
 	uintptr_t env_break;
 	// Address space
 	pde_t *env_pgdir;		// Kernel virtual address of page dir
 	pde_t *env_kern_pgdir;	// Kernel virtual address of page dir
+	bool env_nokpti;		// env_pgdir maps the kernel too
 
 	// Exception handling
 	void *env_pgfault_upcall;	// Page fault upcall entry point
 
+	// Asynchronous system calls (see sys_ring_setup)
+	struct SyscallRing *env_ring;	// User address of the ring, or 0
+
+	// System call tracing (see sys_trace)
+	envid_t env_tracer;		// Env that traces us and our children, or 0
+
 	// Lab 4 IPC
 	bool env_ipc_recving;		// Env is blocked receiving
 	void *env_ipc_dstva;		// VA at which to map received page
@@ -32,6 +32,7 @@ void umain(int argc, char **argv);
 extern const char *binaryname;
 extern const volatile struct Env *thisenv;
 extern const volatile struct Env envs[NENV];
+extern const volatile struct TimeInfo timeinfo;
 extern const volatile struct PageInfo pages[];
 
 // exit.c
@@ -64,6 +65,14 @@ int sys_net_send(const void *buf, uint32_t len);
 int sys_net_recv(void *buf, uint32_t len);
 int sys_exec(envid_t envid);
 int sys_read_mac(uint8_t *mac_addr);
+int sys_env_set_priority(envid_t envid, int prio);
+int sys_env_set_affinity(envid_t envid, uint32_t cpumask);
+int sys_sleep_until(unsigned int msec);
+int sys_yield_to(envid_t envid);
+int sys_batch(struct SyscallOp *ops, int n);
+int sys_trace(int on, struct SyscallTrace *buf, int n);
+int sys_ring_setup(struct SyscallRing *ring);
+int sys_ring_enter(void);
 
 // This must be inlined.  Exercise for reader: why?
 static inline envid_t __attribute__((always_inline))
@@ -81,6 +90,17 @@ void ipc_send(envid_t to_env, uint32_t value, void *pg, int perm);
 int32_t ipc_recv(envid_t *from_env_store, void *pg, int *perm_store);
 envid_t ipc_find_env(enum EnvType type);
 
+// batch.c
+int batch_add(uint32_t num, uint32_t a1, uint32_t a2, uint32_t a3,
+	      uint32_t a4, uint32_t a5);
+int batch_flush(void);
+void batch_discard(void);
+
+// ring.c
+int ring_submit(uint32_t num, uint32_t a1, uint32_t a2, uint32_t a3,
+		uint32_t a4, uint32_t a5, uint32_t data);
+int ring_reap(uint32_t *data_store, int32_t *result_store);
+
 // fork.c
 #define PTE_SHARE 0x400
 envid_t fork(void);
@@ -50,7 +50,9 @@
  *    UVPT      ---->  +------------------------------+ 0xef400000
  *                     |          RO PAGES            | R-/R-  PTSIZE
  *    UPAGES    ---->  +------------------------------+ 0xef000000
- *                     |           RO ENVS            | R-/R-  PTSIZE
+ *                     |         RO TIME INFO         | R-/R-  PGSIZE
+ *    UTIME     ---->  + - - - - - - - - - - - - - - -+ 0xeefff000
+ *                     |           RO ENVS            | R-/R-
  * UTOP,UENVS ------>  +------------------------------+ 0xeec00000
  * UXSTACKTOP -/       |     User Exception Stack     | RW/RW  PGSIZE
  *                     +------------------------------+ 0xeebff000
@@ -114,6 +116,8 @@
 #define UPAGES		(UVPT - PTSIZE)
 // Read-only copies of the global env structures
 #define UENVS		(UPAGES - PTSIZE)
+// Read-only page of kernel time information, above the envs
+#define UTIME		(UPAGES - PGSIZE)
 
 /*
  * Top of user VM. User can manipulate VA from UTOP-1 and down!
@@ -185,6 +189,24 @@ struct PageInfo {
 	// boot_alloc do not have valid reference count fields.
 
 	uint16_t pp_ref;
+
+	// For the first page of a free block in the kernel's buddy
+	// allocator: the block is 2^pp_order pages, and pp_pprev points
+	// at the link to it.  pp_pprev is NULL for every other page.
+	uint8_t pp_order;
+	struct PageInfo **pp_pprev;
+};
+
+/*
+ * Time information, mapped at UTIME.
+ * Read/write to the kernel, read-only to user programs.
+ *
+ * User programs can compute the kernel's time_msec() themselves as
+ * (rdtsc - ti_tsc_boot) / ti_tsc_per_msec, without a system call.
+ */
+struct TimeInfo {
+	uint64_t ti_tsc_boot;		// TSC when time_msec() was 0
+	uint32_t ti_tsc_per_msec;	// TSC ticks per millisecond
 };
 
 #endif /* !__ASSEMBLER__ */
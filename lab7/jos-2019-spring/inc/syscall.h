@@ -1,6 +1,8 @@
 #ifndef JOS_INC_SYSCALL_H
 #define JOS_INC_SYSCALL_H
 
+#include <inc/types.h>
+
 /* system call numbers */
 enum
 {
@@ -25,9 +27,71 @@ enum
 	SYS_net_recv,
 	SYS_exec,
 	SYS_read_mac,
+	SYS_env_set_priority,
+	SYS_env_set_affinity,
+	SYS_sleep_until,
+	SYS_yield_to,
+	SYS_batch,
+	SYS_trace,
+	SYS_ring_setup,
+	SYS_ring_enter,
 	NSYSCALLS
 };
 
+// One system call for sys_batch to make: its number and arguments, as
+// they would be passed to syscall(), and where to put what it returns.
+struct SyscallOp
+{
+	uint32_t num;
+	uint32_t args[5];
+	int32_t result;
+};
+
+// One system call recorded by syscall tracing (see sys_trace).
+// tsc_exit is 0 if the call had not returned when it was read, or
+// never returns to its caller, like sys_yield.
+struct SyscallTrace
+{
+	int32_t env;		// env_id of the caller
+	uint32_t num;
+	uint32_t args[5];
+	int32_t result;
+	uint64_t tsc_enter;
+	uint64_t tsc_exit;
+};
+
+// A page shared between an environment and the kernel, through which
+// the environment can make system calls without entering the kernel
+// for each one (see sys_ring_setup).  Each index counts up forever,
+// and the entry it names is at the index modulo NRING.  The user adds
+// submissions at sq_tail and takes completions from cq_head; the
+// kernel takes submissions from sq_head and adds completions at
+// cq_tail.
+#define NRING 64
+
+struct RingSqe
+{
+	uint32_t num;
+	uint32_t args[5];
+	uint32_t data;		// Passed back in the completion
+};
+
+struct RingCqe
+{
+	uint32_t data;
+	int32_t result;
+};
+
+struct SyscallRing
+{
+	volatile uint32_t sq_head;
+	volatile uint32_t sq_tail;
+	volatile uint32_t cq_head;
+	volatile uint32_t cq_tail;
+	struct RingSqe sq[NRING];
+	struct RingCqe cq[NRING];
+};
+
 #endif /* !JOS_INC_SYSCALL_H */
 
 
@@ -38,6 +38,7 @@
 #define IRQ_SPURIOUS     7
 #define IRQ_IDE         14
 #define IRQ_ERROR       19
+#define IRQ_RESCHED     20	// Reschedule IPI, sent by kern/sched.c
 
 #ifndef __ASSEMBLER__
 
@@ -261,6 +261,37 @@ xchg(volatile uint32_t *addr, uint32_t newval)
 	return result;
 }
 
+// Atomically set *addr to newval if it is oldval.  Returns the old *addr.
+static inline uint32_t
+cmpxchg(volatile uint32_t *addr, uint32_t oldval, uint32_t newval)
+{
+	uint32_t result;
+
+	asm volatile("lock; cmpxchgl %2, %1"
+		     : "=a" (result), "+m" (*addr)
+		     : "r" (newval), "0" (oldval)
+		     : "cc");
+	return result;
+}
+
+// Atomically add inc to *addr.  Returns the old *addr.
+static inline uint32_t
+xadd(volatile uint32_t *addr, uint32_t inc)
+{
+	asm volatile("lock; xaddl %0, %1"
+		     : "+r" (inc), "+m" (*addr)
+		     : : "cc");
+	return inc;
+}
+
+// CPUID leaf 1 %edx feature bits
+#define CPUID_SEP	(1 << 11)	// sysenter and sysexit
+
+// Model-specific registers
+#define MSR_SYSENTER_CS		0x174
+#define MSR_SYSENTER_ESP	0x175
+#define MSR_SYSENTER_EIP	0x176
+
 static inline void
 wrmsr(uint32_t msr, uint32_t val1, uint32_t val2)
 {
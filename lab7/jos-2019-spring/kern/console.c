@@ -9,6 +9,8 @@
 #include <kern/console.h>
 #include <kern/trap.h>
 #include <kern/picirq.h>
+#include <kern/cpu.h>
+#include <kern/spinlock.h>
 
 static void cons_intr(int (*proc)(void));
 static void cons_putc(int c);
@@ -398,6 +400,35 @@ static struct {
 	uint32_t wpos;
 } cons;
 
+// The console devices and the input buffer are shared by all CPUs.
+// The lock is recursive, so cprintf() can hold it for a whole message
+// while cputchar() takes it for each character, and a panic in the
+// middle of a message can still print.
+static struct spinlock cons_spinlock = SPINLOCK_INIT(cons_spinlock);
+static volatile int cons_owner = -1;	// CPU holding cons_spinlock
+static int cons_depth;
+
+void
+cons_lock(void)
+{
+	if (cons_owner == cpunum()) {
+		cons_depth++;
+		return;
+	}
+	spin_lock(&cons_spinlock);
+	cons_owner = cpunum();
+	cons_depth = 1;
+}
+
+void
+cons_unlock(void)
+{
+	if (--cons_depth == 0) {
+		cons_owner = -1;
+		spin_unlock(&cons_spinlock);
+	}
+}
+
 // called by device interrupt routines to feed input characters
 // into the circular console input buffer.
 static void
@@ -405,6 +436,7 @@ cons_intr(int (*proc)(void))
 {
 	int c;
 
+	cons_lock();
 	while ((c = (*proc)()) != -1) {
 		if (c == 0)
 			continue;
@@ -412,14 +444,16 @@ cons_intr(int (*proc)(void))
 		if (cons.wpos == CONSBUFSIZE)
 			cons.wpos = 0;
 	}
+	cons_unlock();
 }
 
 // return the next input character from the console, or 0 if none waiting
 int
 cons_getc(void)
 {
-	int c;
+	int c = 0;
 
+	cons_lock();
 	// poll for any pending input characters,
 	// so that this function works even when interrupts are disabled
 	// (e.g., when called from the kernel monitor).
@@ -431,9 +465,9 @@ cons_getc(void)
 		c = cons.buf[cons.rpos++];
 		if (cons.rpos == CONSBUFSIZE)
 			cons.rpos = 0;
-		return c;
 	}
-	return 0;
+	cons_unlock();
+	return c;
 }
 
 // output a character to the console
@@ -463,7 +497,9 @@ cons_init(void)
 void
 cputchar(int c)
 {
+	cons_lock();
 	cons_putc(c);
+	cons_unlock();
 }
 
 int
@@ -34,13 +34,31 @@ extern physaddr_t lapicaddr;        // Physical MMIO address of the local APIC
 // Per-CPU kernel stacks
 extern unsigned char percpu_kstacks[NCPU][KSTKSIZE];
 
-int cpunum(void);
+int lapic_cpunum(void);
+
+// The CPU we are running on.  trap_init_percpu loads the selector of
+// each CPU's own TSS into its task register, so str alone tells the
+// CPUs apart, with no memory access or local APIC read; until then,
+// ask the local APIC.
+static inline int
+cpunum(void)
+{
+	uint16_t tr;
+
+	asm volatile("str %0" : "=r" (tr));
+	if (tr)
+		return (tr - GD_TSS0) >> 3;
+	return lapic_cpunum();
+}
+
 #define thiscpu (&cpus[cpunum()])
 
 void mp_init(void);
 void lapic_init(void);
 void lapic_startap(uint8_t apicid, uint32_t addr);
 void lapic_eoi(void);
+void lapic_timer_oneshot(unsigned int msec);
 void lapic_ipi(int vector);
+void lapic_ipi_cpu(int cpu, int vector);
 
 #endif
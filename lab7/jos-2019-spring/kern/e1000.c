@@ -1,16 +1,25 @@
 #include <kern/e1000.h>
 #include <kern/pmap.h>
+#include <kern/spinlock.h>
 #include <inc/string.h>
 #include <inc/error.h>
 
 #define MAX_TX_PKTSIZE 1518
 #define MAX_RX_PKTSIZE 2048
 
+// The descriptor rings and packet buffers come from page_alloc_order,
+// so they can be more than a page and stay out of the kernel image.
+#define RING_ORDER 1		// Each ring is 2^RING_ORDER pages
+#define BUF_SIZE 2048		// Room for one packet, sent or received
+// Packet buffers for a ring of 2^RING_ORDER pages of 16-byte descriptors
+#define BUF_ORDER (RING_ORDER + 7)
+
 volatile uint32_t *e1000_base_addr;
+// Protects the descriptor rings and the TDT/RDT registers
+static struct spinlock e1000_lock = SPINLOCK_INIT(e1000_lock);
 struct tx_desc *tx_descs;
-#define N_TXDESC (PGSIZE / sizeof(struct tx_desc))
-// struct tx_desc tx_descs[N_TXDESC] __attribute__((aligned(16)));
-char tx_buf[N_TXDESC][MAX_TX_PKTSIZE];
+#define N_TXDESC ((PGSIZE << RING_ORDER) / sizeof(struct tx_desc))
+static char (*tx_buf)[BUF_SIZE];
 
 // challenge!
 uint16_t e1000_eeprom_read_register(uint8_t address)
@@ -27,16 +36,19 @@ uint16_t e1000_eeprom_read_register(uint8_t address)
 
 int e1000_tx_init()
 {
-	// Allocate one page for descriptors
+	// Allocate the descriptor ring and packet buffers
 
 	// Initialize all descriptors
 
 	// Set hardward registers
 	// Look kern/e1000.h to find useful definations
-	// cprintf("global addr: %08x\n", tx_descs);
-	// struct tx_desc* tx_descss;
-	tx_descs = (struct tx_desc *)page2kva(page_alloc(ALLOC_ZERO));
-	cprintf("alloc addr: %08x\n", tx_descs);
+	struct PageInfo *ring = page_alloc_order(RING_ORDER, ALLOC_ZERO);
+	struct PageInfo *bufs = page_alloc_order(BUF_ORDER, 0);
+	if (ring == NULL || bufs == NULL)
+		panic("e1000_tx_init: out of memory");
+	tx_descs = (struct tx_desc *)page2kva(ring);
+	tx_buf = page2kva(bufs);
+	static_assert(N_TXDESC * BUF_SIZE == PGSIZE << BUF_ORDER);
 	for (int i = 0; i < N_TXDESC; i++)
 	{
 		tx_descs[i].addr = PADDR(tx_buf[i]);
@@ -45,7 +57,7 @@ int e1000_tx_init()
 
 	base->TDBAL = PADDR(tx_descs);
 	base->TDBAH = 0;
-	base->TDLEN = PGSIZE;
+	base->TDLEN = PGSIZE << RING_ORDER;
 	base->TDH = 0;
 	base->TDT = 0;
 	base->TCTL |= E1000_TCTL_EN;
@@ -57,12 +69,12 @@ int e1000_tx_init()
 }
 
 struct rx_desc *rx_descs;
-#define N_RXDESC (PGSIZE / sizeof(struct rx_desc))
-char rx_buf[N_RXDESC][MAX_RX_PKTSIZE];
+#define N_RXDESC ((PGSIZE << RING_ORDER) / sizeof(struct rx_desc))
+static char (*rx_buf)[BUF_SIZE];
 
 int e1000_rx_init()
 {
-	// Allocate one page for descriptors
+	// Allocate the descriptor ring and packet buffers
 
 	// Initialize all descriptors
 	// You should allocate some pages as receive buffer
@@ -88,7 +100,13 @@ int e1000_rx_init()
 		base->MTA[i] = 0;
 	}
 
-	rx_descs = (struct rx_desc *)page2kva(page_alloc(ALLOC_ZERO));
+	struct PageInfo *ring = page_alloc_order(RING_ORDER, ALLOC_ZERO);
+	struct PageInfo *bufs = page_alloc_order(BUF_ORDER, 0);
+	if (ring == NULL || bufs == NULL)
+		panic("e1000_rx_init: out of memory");
+	rx_descs = (struct rx_desc *)page2kva(ring);
+	rx_buf = page2kva(bufs);
+	static_assert(N_RXDESC * BUF_SIZE == PGSIZE << BUF_ORDER);
 	for (int i = 0; i < N_RXDESC; i++)
 	{
 		rx_descs[i].addr = PADDR(rx_buf[i]);
@@ -96,7 +114,7 @@ int e1000_rx_init()
 
 	base->RDBAL = PADDR(rx_descs);
 	base->RDBAH = 0;
-	base->RDLEN = PGSIZE;
+	base->RDLEN = PGSIZE << RING_ORDER;
 	base->RDH = 0;
 	base->RDT = N_RXDESC - 1;
 	base->RCTL |= E1000_RCTL_EN;
@@ -130,9 +148,11 @@ int e1000_tx(const void *buf, uint32_t len)
 		return -E_INVAL;
 	}
 
+	spin_lock(&e1000_lock);
 	uint32_t tail = base->TDT;
 	if ((tx_descs[tail].status & E1000_TX_STATUS_DD) == 0)
 	{
+		spin_unlock(&e1000_lock);
 		return -E_AGAIN;
 	}
 
@@ -145,6 +165,7 @@ int e1000_tx(const void *buf, uint32_t len)
 	tx_descs[tail].status &= ~E1000_TX_STATUS_DD;
 
 	base->TDT = (base->TDT + 1) % N_TXDESC;
+	spin_unlock(&e1000_lock);
 	return 0;
 }
 
@@ -162,10 +183,12 @@ int e1000_rx(void *buf, uint32_t len)
 		return -E_INVAL;
 	}
 
+	spin_lock(&e1000_lock);
 	uint32_t tail = base->RDT;
 	tail = (tail + 1) % N_RXDESC;
 	if ((rx_descs[tail].status & E1000_RX_STATUS_DD) == 0)
 	{
+		spin_unlock(&e1000_lock);
 		return -E_AGAIN;
 	}
 
@@ -177,6 +200,7 @@ int e1000_rx(void *buf, uint32_t len)
 	rx_descs[tail].status &= ~E1000_RX_STATUS_DD;
 	rx_descs[tail].status &= ~E1000_RX_STATUS_EOP;
 	base->RDT = tail;
+	spin_unlock(&e1000_lock);
 	return len;
 }
 
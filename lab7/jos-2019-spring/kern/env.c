@@ -20,6 +20,14 @@ struct Env *envs = NULL;					// All environments
 static struct Env *env_free_list; // Free environment list
 																	// (linked by Env->env_link)
 
+// Protects env_free_list, the IPC fields of every env, and any env
+// other than curenv while a syscall uses it: an env is only freed with
+// env_lock held, except by itself.
+struct spinlock env_lock = SPINLOCK_INIT(env_lock);
+
+// Per-env locks for changes to an env's page tables, indexed like envs
+static struct spinlock env_vm_locks[NENV];
+
 #define ENVGENSHIFT 12 // >= LOGNENV
 
 // Global descriptor table.
@@ -123,13 +131,74 @@ void env_init(void)
 	{
 		envs[i].env_id = 0;
 		envs[i].env_status = ENV_FREE;
+		envs[i].env_rq_cpu = -1;
 		envs[i].env_link = env_free_list;
 		env_free_list = &envs[i];
+		__spin_initlock(&env_vm_locks[i], "env_vm_lock");
 	}
 	// Per-CPU part of the initialization
 	env_init_percpu();
 }
 
+// Lock e's page tables against changes from other CPUs.
+void env_vm_lock(struct Env *e)
+{
+	spin_lock(&env_vm_locks[e - envs]);
+}
+
+void env_vm_unlock(struct Env *e)
+{
+	spin_unlock(&env_vm_locks[e - envs]);
+}
+
+// Lock the page tables of both a and b, which may be the same env,
+// in an order that can't deadlock with another CPU doing the same.
+void env_vm_lock2(struct Env *a, struct Env *b)
+{
+	if (a > b)
+		env_vm_lock2(b, a);
+	else
+	{
+		env_vm_lock(a);
+		if (a != b)
+			env_vm_lock(b);
+	}
+}
+
+void env_vm_unlock2(struct Env *a, struct Env *b)
+{
+	env_vm_unlock(a);
+	if (a != b)
+		env_vm_unlock(b);
+}
+
+// Below UTOP, env_pgdir and env_kern_pgdir point at the same page
+// tables, so a user mapping made in one is there in the other too.
+// Map user pages only through env_page_insert and env_page_remove,
+// which keep it that way.  The caller holds e's vm lock.
+
+// Like page_insert on e's address space.  A page table created for
+// 'va' goes into both page directories before the page is mapped.
+int env_page_insert(struct Env *e, struct PageInfo *pp, void *va, int perm)
+{
+	assert((uintptr_t)va < UTOP);
+	if (!(e->env_pgdir[PDX(va)] & PTE_P))
+	{
+		if (pgdir_walk(e->env_pgdir, va, 1) == NULL)
+			return -E_NO_MEM;
+		e->env_kern_pgdir[PDX(va)] = e->env_pgdir[PDX(va)];
+	}
+	return page_insert(e->env_pgdir, pp, va, perm);
+}
+
+// Like page_remove on e's address space.  Page tables are only freed
+// by env_free, so there is nothing to do to env_kern_pgdir.
+void env_page_remove(struct Env *e, void *va)
+{
+	assert((uintptr_t)va < UTOP);
+	page_remove(e->env_pgdir, va);
+}
+
 // Load GDT and segment descriptors.
 void env_init_percpu(void)
 {
@@ -239,6 +308,9 @@ env_setup_vm(struct Env *e)
 	return 0;
 }
 
+static int __env_alloc(struct Env **newenv_store, envid_t parent_id);
+static int __env_alloc_fork(struct Env **newenv_store, envid_t parent_id);
+
 //
 // Allocates and initializes a new environment.
 // On success, the new environment is stored in *newenv_store.
@@ -248,6 +320,31 @@ env_setup_vm(struct Env *e)
 //	-E_NO_MEM on memory exhaustion
 //
 __user_mapped_text int env_alloc(struct Env **newenv_store, envid_t parent_id)
+{
+	int r;
+
+	spin_lock(&env_lock);
+	r = __env_alloc(newenv_store, parent_id);
+	spin_unlock(&env_lock);
+	return r;
+}
+
+// Like env_alloc, but for sys_exofork: the new environment is left
+// ENV_NOT_RUNNABLE, so no CPU can run it before its parent has set
+// up its registers.
+__user_mapped_text int env_alloc_fork(struct Env **newenv_store, envid_t parent_id)
+{
+	int r;
+
+	spin_lock(&env_lock);
+	r = __env_alloc_fork(newenv_store, parent_id);
+	spin_unlock(&env_lock);
+	return r;
+}
+
+// env_alloc() with env_lock held.
+static int
+__env_alloc(struct Env **newenv_store, envid_t parent_id)
 {
 	int32_t generation;
 	int r;
@@ -268,7 +365,16 @@ __user_mapped_text int env_alloc(struct Env **newenv_store, envid_t parent_id)
 	// Set the basic status variables.
 	e->env_parent_id = parent_id;
 	e->env_type = ENV_TYPE_USER;
-	e->env_status = ENV_RUNNABLE;
+	e->env_prio_base = ENV_PRIO_NORMAL;
+	e->env_affinity = ~0;
+	e->env_cpunum = -1;
+	e->env_runtime = e->env_max_wait = 0;
+	e->env_vruntime = 0;
+	e->env_ring = 0;
+	e->env_nokpti = 0;
+	// Children are traced by whoever traces their parent
+	e->env_tracer = (curenv && curenv->env_id == parent_id) ? curenv->env_tracer : 0;
+	sched_set_status(e, ENV_RUNNABLE);
 	e->env_runs = 0;
 
 	// Clear out all the saved register state,
@@ -311,7 +417,9 @@ __user_mapped_text int env_alloc(struct Env **newenv_store, envid_t parent_id)
 	return 0;
 }
 
-__user_mapped_text int env_alloc_fork(struct Env **newenv_store, envid_t parent_id)
+// env_alloc_fork() with env_lock held.
+static int
+__env_alloc_fork(struct Env **newenv_store, envid_t parent_id)
 {
 	int32_t generation;
 	int r;
@@ -332,7 +440,16 @@ __user_mapped_text int env_alloc_fork(struct Env **newenv_store, envid_t parent_
 	// Set the basic status variables.
 	e->env_parent_id = parent_id;
 	e->env_type = ENV_TYPE_USER;
-	e->env_status = ENV_RUNNABLE;
+	e->env_prio_base = ENV_PRIO_NORMAL;
+	e->env_affinity = ~0;
+	e->env_cpunum = -1;
+	e->env_runtime = e->env_max_wait = 0;
+	e->env_vruntime = 0;
+	e->env_ring = 0;
+	e->env_nokpti = 0;
+	// Children are traced by whoever traces their parent
+	e->env_tracer = (curenv && curenv->env_id == parent_id) ? curenv->env_tracer : 0;
+	sched_set_status(e, ENV_NOT_RUNNABLE);
 	e->env_runs = 0;
 
 	// Clear out all the saved register state,
@@ -435,8 +552,10 @@ void region_alloc(struct Env *e, void *va, size_t len)
 		{
 			panic("region_alloc: page_alloc error!\n");
 		}
-		page_insert(e->env_pgdir, p, (void *)va_seg, PTE_U | PTE_W);
-		memmove(e->env_kern_pgdir + PDX(va_seg), e->env_pgdir + PDX(va_seg), sizeof(pde_t));
+		if (env_page_insert(e, p, (void *)va_seg, PTE_U | PTE_W) < 0)
+		{
+			panic("region_alloc: env_page_insert error!\n");
+		}
 	}
 }
 
@@ -559,8 +678,20 @@ void env_create(uint8_t *binary, enum EnvType type)
 	{
 		e->env_tf.tf_eflags |= FL_IOPL_MASK;
 	}
+	// Keep the servers responsive when user jobs load the CPUs.
+	if (type == ENV_TYPE_FS || type == ENV_TYPE_NS)
+		sched_set_priority(e, ENV_PRIO_HIGH);
 	load_icode(e, binary);
 	memmove(e->env_kern_pgdir, e->env_pgdir, sizeof(pde_t) * NPDENTRIES);
+#ifdef KPTI_TRUSTED_SERVERS
+	// Trust the servers with the kernel's mappings: leave env_pgdir
+	// as complete as env_kern_pgdir, and never switch between them.
+	if (type == ENV_TYPE_FS || type == ENV_TYPE_NS)
+	{
+		e->env_nokpti = 1;
+		return;
+	}
+#endif
 	memset(e->env_pgdir + PDX(ULIM), 0, sizeof(pde_t) * (NPDENTRIES - PDX(ULIM)));
 	// cprintf("clear start!\n");
 	pde_t *pgdir = e->env_pgdir;
@@ -597,6 +728,7 @@ void env_create(uint8_t *binary, enum EnvType type)
 
 //
 // Frees env e and all memory it uses.
+// The caller must hold env_lock.
 //
 void env_free(struct Env *e)
 {
@@ -631,47 +763,50 @@ void env_free(struct Env *e)
 		{
 			if (pt[pteno] & PTE_P)
 			{
-				page_remove(e->env_pgdir, PGADDR(pdeno, pteno, 0));
-				memmove(e->env_kern_pgdir + PDX(PGADDR(pdeno, pteno, 0)), e->env_pgdir + PDX(PGADDR(pdeno, pteno, 0)), sizeof(pde_t));
+				env_page_remove(e, PGADDR(pdeno, pteno, 0));
 			}
 		}
 
-		// free the page table itself
+		// free the page table itself, which env_kern_pgdir shares
 		e->env_pgdir[pdeno] = 0;
 		e->env_kern_pgdir[pdeno] = 0;
 		page_decref(pa2page(pa));
 	}
 
-	// free addr > UTOP in env_pgdir
-	for (pdeno = PDX(ULIM);; pdeno++)
+	// free addr > UTOP in env_pgdir (unless it's an env without KPTI,
+	// whose page tables there are the kernel's)
+	if (!e->env_nokpti)
 	{
-
-		// only look at mapped page tables
-		if (pdeno == PDX(~0))
+		for (pdeno = PDX(ULIM);; pdeno++)
 		{
-			break;
-		}
-		if (!(e->env_pgdir[pdeno] & PTE_P))
-			continue;
-		// find the pa and va of the page table
-		pa = PTE_ADDR(e->env_pgdir[pdeno]);
-		pt = (pte_t *)KADDR(pa);
 
-		// unmap all PTEs in this page table
-		for (pteno = 0; pteno <= PTX(~0); pteno++)
-		{
-			if (pt[pteno] & PTE_P)
+			// only look at mapped page tables
+			if (pdeno == PDX(~0))
 			{
-				page_remove(e->env_pgdir, PGADDR(pdeno, pteno, 0));
+				break;
+			}
+			if (!(e->env_pgdir[pdeno] & PTE_P))
+				continue;
+			// find the pa and va of the page table
+			pa = PTE_ADDR(e->env_pgdir[pdeno]);
+			pt = (pte_t *)KADDR(pa);
+
+			// unmap all PTEs in this page table
+			for (pteno = 0; pteno <= PTX(~0); pteno++)
+			{
+				if (pt[pteno] & PTE_P)
+				{
+					page_remove(e->env_pgdir, PGADDR(pdeno, pteno, 0));
+				}
 			}
-		}
 
-		// free the page table itself
-		e->env_pgdir[pdeno] = 0;
-		page_decref(pa2page(pa));
-		if (pdeno == PDX(~0))
-		{
-			break;
+			// free the page table itself
+			e->env_pgdir[pdeno] = 0;
+			page_decref(pa2page(pa));
+			if (pdeno == PDX(~0))
+			{
+				break;
+			}
 		}
 	}
 
@@ -685,28 +820,35 @@ void env_free(struct Env *e)
 	page_decref(pa2page(pa));
 
 	// return the environment to the free list
-	e->env_status = ENV_FREE;
+	sched_set_status(e, ENV_FREE);
 	e->env_link = env_free_list;
 	env_free_list = e;
 }
 
 //
-// Frees environment e.
-// If e was the current env, then runs a new environment (and does not return
-// to the caller).
+// Frees environment e with env_lock held, or leaves it to the CPU
+// that is running it.
 //
-void env_destroy(struct Env *e)
+void env_kill(struct Env *e)
 {
 	// If e is currently running on other CPUs, we change its state to
 	// ENV_DYING. A zombie environment will be freed the next time
-	// it traps to the kernel.
-	if (e->env_status == ENV_RUNNING && curenv != e)
-	{
-		e->env_status = ENV_DYING;
-		return;
-	}
+	// it traps to the kernel.  sched_set_dying also makes sure two
+	// CPUs destroying e at the same time don't both free it.
+	if (sched_set_dying(e))
+		env_free(e);
+}
 
-	env_free(e);
+//
+// Frees environment e.
+// If e was the current env, then runs a new environment (and does not return
+// to the caller).  The caller must not hold env_lock.
+//
+void env_destroy(struct Env *e)
+{
+	spin_lock(&env_lock);
+	env_kill(e);
+	spin_unlock(&env_lock);
 
 	if (curenv == e)
 	{
@@ -818,7 +960,8 @@ __user_mapped_text void env_run(struct Env *e)
 {
 	// Verify no sensitive kernel page has PTE_P
 	// cprintf("start check!\n");
-	check_isolate(e);
+	if (!e->env_nokpti)
+		check_isolate(e);
 
 	// Step 1: If this is a context switch (a new environment is running):
 	//	   1. Set the current environment (if any) back to
@@ -838,20 +981,17 @@ __user_mapped_text void env_run(struct Env *e)
 	//	e->env_tf to sensible values.
 
 	// LAB 3: Your code here.
-	// cprintf("start run!\n");
-	if (curenv != e)
-	{
-		if (curenv != NULL && curenv->env_status == ENV_RUNNING)
-		{
-			curenv->env_status = ENV_RUNNABLE;
-		}
-		curenv = e;
-		curenv->env_status = ENV_RUNNING;
-		curenv->env_runs++;
-		curenv->env_cpunum = cpunum();
-	}
-	lcr3(PADDR(e->env_pgdir));
-	// cprintf("unlock!\n");
-	unlock_kernel();
+	// Step 1 happens in sched_run() in kern/sched.c, under the
+	// scheduler's lock, so that no two CPUs can pick the same
+	// environment.  By the time we get here, e is curenv and
+	// ENV_RUNNING.
+	//
+	// Traps from e push its registers straight into e->env_tf (see
+	// kern/trapentry.S), so there is nothing to copy on either side.
+	thiscpu->cpu_ts.ts_esp0 = (uintptr_t)(&e->env_tf + 1);
+	// Loading cr3 flushes the TLB.  An env without KPTI that trapped
+	// on this CPU is still on its own page table, so skip it.
+	if (rcr3() != PADDR(e->env_pgdir))
+		lcr3(PADDR(e->env_pgdir));
 	env_pop_tf(&e->env_tf);
 }
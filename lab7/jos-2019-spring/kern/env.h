@@ -6,7 +6,11 @@
 #include <inc/env.h>
 #include <kern/cpu.h>
 
+struct spinlock;
+struct PageInfo;
+
 extern struct Env *envs;		// All environments
+extern struct spinlock env_lock;	// See kern/env.c
 #define curenv (thiscpu->cpu_env)		// Current environment
 extern struct Segdesc gdt[];
 
@@ -17,6 +21,13 @@ int env_alloc_fork(struct Env **e, envid_t parent_id);
 void env_free(struct Env *e);
 void env_create(uint8_t *binary, enum EnvType type);
 void env_destroy(struct Env *e); // Does not return if e == curenv
+void env_kill(struct Env *e);	 // Caller holds env_lock
+void env_vm_lock(struct Env *e);
+void env_vm_unlock(struct Env *e);
+void env_vm_lock2(struct Env *a, struct Env *b);
+void env_vm_unlock2(struct Env *a, struct Env *b);
+int env_page_insert(struct Env *e, struct PageInfo *pp, void *va, int perm);
+void env_page_remove(struct Env *e, void *va);
 
 int envid2env(envid_t envid, struct Env **env_store, bool checkperm);
 // The following two functions do not return
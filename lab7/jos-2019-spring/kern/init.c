@@ -20,6 +20,11 @@
 
 static void boot_aps(void);
 
+// Set by the boot CPU once it has created the first environments.
+// Until then the other CPUs wait in mp_main(), or they would find
+// nothing to run.
+static volatile uint32_t boot_envs_ready;
+
 void i386_init(void)
 {
 	extern char edata[], end[];
@@ -52,19 +57,16 @@ void i386_init(void)
 
 	// Lab 4 multiprocessor initialization functions
 	mp_init();
+	time_init();
 	lapic_init();
 
 	// Lab 4 multitasking initialization functions
 	pic_init();
 
 	// Lab 6 hardware initialization functions
-	time_init();
 	pci_init();
 	// char test[100] = "11111111";
 	// e1000_tx(test, 5);
-	// Acquire the big kernel lock before waking up APs
-	// Your code here:
-	lock_kernel();
 	// Starting non-boot CPUs
 	boot_aps();
 
@@ -93,6 +95,8 @@ void i386_init(void)
 	// Should not be necessary - drains keyboard because interrupt has given up.
 	kbd_intr();
 	cprintf("2222\n");
+	// Let the other CPUs in
+	xchg(&boot_envs_ready, 1);
 	// Schedule and run the first user environment!
 	sched_yield();
 }
@@ -147,11 +151,12 @@ void mp_main(void)
 	xchg(&thiscpu->cpu_status, CPU_STARTED); // tell boot_aps() we're up
 
 	// Now that we have finished some basic setup, call sched_yield()
-	// to start running processes on this CPU.  But make sure that
-	// only one CPU can enter the scheduler at a time!
+	// to start running processes on this CPU, once the boot CPU has
+	// created some.  sched_lock keeps CPUs out of each other's way.
 	//
 	// Your code here:
-	lock_kernel();
+	while (!boot_envs_ready)
+		asm volatile("pause");
 	sched_yield();
 	// Remove this after you finish Exercise 6
 	// for (;;)
@@ -3,6 +3,11 @@
 
 #include <kern/cpu.h>
 
+// Run the file and network servers on a single page table that also
+// maps the kernel, so their traps and system calls don't switch page
+// tables.  Comment this out to isolate them like every other env.
+#define KPTI_TRUSTED_SERVERS
+
 #define __user_mapped_text __attribute__((section(".user_mapped.text")))
 #define __user_mapped_data __attribute__((section(".user_mapped.data")))
 
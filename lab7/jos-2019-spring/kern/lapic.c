@@ -10,6 +10,7 @@
 #include <kern/pmap.h>
 #include <kern/cpu.h>
 #include <kern/kpti.h>
+#include <kern/time.h>
 
 // Local APIC registers, divided by 4 for use as uint32_t[] indices.
 #define ID (0x0020 / 4)		 // ID
@@ -33,6 +34,7 @@
 #define ICRHI (0x0310 / 4)	// Interrupt Command [63:32]
 #define TIMER (0x0320 / 4)	// Local Vector Table 0 (TIMER)
 #define X1 0x0000000B				// divide counts by 1
+#define ONESHOT 0x00000000	// One-shot
 #define PERIODIC 0x00020000 // Periodic
 #define PCINT (0x0340 / 4)	// Performance Counter LVT
 #define LINT0 (0x0350 / 4)	// Local Vector Table 1 (LINT0)
@@ -46,6 +48,9 @@
 physaddr_t lapicaddr; // Initialized in mpconfig.c
 volatile uint32_t *lapic;
 
+// Timer counts per millisecond, measured by the BSP in lapic_init
+static uint32_t lapic_timer_freq;
+
 static void
 lapicw(int index, int value)
 {
@@ -65,13 +70,27 @@ void lapic_init(void)
 	// Enable local APIC; set spurious interrupt vector.
 	lapicw(SVR, ENABLE | (IRQ_OFFSET + IRQ_SPURIOUS));
 
-	// The timer repeatedly counts down at bus frequency
-	// from lapic[TICR] and then issues an interrupt.
-	// If we cared more about precise timekeeping,
-	// TICR would be calibrated using an external time source.
+	// The timer counts down at bus frequency from lapic[TICR] and
+	// then issues an interrupt.  The BSP measures how fast it counts
+	// against the TSC, which time_init() has already calibrated; the
+	// bus clock is the same for all CPUs.
 	lapicw(TDCR, X1);
+	if (!lapic_timer_freq)
+	{
+		lapicw(TIMER, MASKED | ONESHOT);
+		lapicw(TICR, 0xffffffff);
+		time_delay(10);
+		lapic_timer_freq = (0xffffffff - lapic[TCCR]) / 10;
+		lapicw(TICR, 0);
+	}
+#ifdef TICKLESS
+	// Stopped until the scheduler arms it with lapic_timer_oneshot().
+	lapicw(TIMER, ONESHOT | (IRQ_OFFSET + IRQ_TIMER));
+	lapicw(TICR, 0);
+#else
 	lapicw(TIMER, PERIODIC | (IRQ_OFFSET + IRQ_TIMER));
-	lapicw(TICR, 10000000);
+	lapicw(TICR, lapic_timer_freq * TICK_MSEC);
+#endif
 
 	// Leave LINT0 of the BSP enabled so that it can get
 	// interrupts from the 8259A chip.
@@ -112,8 +131,10 @@ void lapic_init(void)
 }
 
 
+// The local APIC ID of this CPU, for cpunum() before this CPU has
+// loaded its task register.
 int
-cpunum(void)
+lapic_cpunum(void)
 {
 	if (lapic)
 		return lapic[ID] >> 24;
@@ -127,6 +148,19 @@ void lapic_eoi(void)
 		lapicw(EOI, 0);
 }
 
+// Interrupt this CPU once, 'msec' milliseconds from now, cancelling
+// any earlier one-shot deadline.
+void lapic_timer_oneshot(unsigned int msec)
+{
+	uint32_t max = 0xffffffff / lapic_timer_freq;
+
+	if (!lapic)
+		return;
+	if (msec > max)
+		msec = max;
+	lapicw(TICR, msec ? msec * lapic_timer_freq : 1);
+}
+
 // Spin for a given number of microseconds.
 // On real hardware would want to tune this dynamically.
 static void
@@ -179,3 +213,12 @@ void lapic_ipi(int vector)
 	while (lapic[ICRLO] & DELIVS)
 		;
 }
+
+// Send interrupt 'vector' to CPU 'cpu' only.
+void lapic_ipi_cpu(int cpu, int vector)
+{
+	lapicw(ICRHI, cpus[cpu].cpu_id << 24);
+	lapicw(ICRLO, FIXED | vector);
+	while (lapic[ICRLO] & DELIVS)
+		;
+}
@@ -12,6 +12,8 @@
 #include <kern/kdebug.h>
 #include <kern/trap.h>
 #include <kern/pmap.h>
+#include <kern/sched.h>
+#include <kern/spinlock.h>
 
 #define CMDBUF_SIZE 80 // enough for one VGA text line
 
@@ -31,7 +33,11 @@ static struct Command commands[] = {
 		{"showmappings", "Display physical memory mappings", mon_showmappings},
 		{"setpermission", "Set permission of mapping", mon_setpermission},
 		{"dumpva", "Dump memory content by virtual address", mon_dumpva},
-		{"dumppa", "Dump memory content by physical address", mon_dumppa}};
+		{"dumppa", "Dump memory content by physical address", mon_dumppa},
+		{"sched", "Display per-CPU run queue statistics", mon_sched},
+		{"locks", "Display spinlock contention statistics", mon_locks},
+		{"lockprof", "Display wait and hold times of the most contended locks", mon_lockprof},
+		{"pages", "Display free pages and per-CPU page cache statistics", mon_pages}};
 
 /***** Implementations of basic kernel monitor commands *****/
 
@@ -243,6 +249,39 @@ int mon_dumppa(int argc, char **argv, struct Trapframe *tf)
 	return 0;
 }
 
+int mon_sched(int argc, char **argv, struct Trapframe *tf)
+{
+	sched_print_stats();
+	return 0;
+}
+
+int mon_locks(int argc, char **argv, struct Trapframe *tf)
+{
+	spin_print_stats();
+	return 0;
+}
+
+int mon_lockprof(int argc, char **argv, struct Trapframe *tf)
+{
+	int n = 5;
+
+	if (argc > 2)
+	{
+		cprintf("Usage: lockprof [number of locks]\n");
+		return 0;
+	}
+	if (argc == 2)
+		n = strtol(argv[1], NULL, 10);
+	spin_print_profile(n);
+	return 0;
+}
+
+int mon_pages(int argc, char **argv, struct Trapframe *tf)
+{
+	page_print_stats();
+	return 0;
+}
+
 // Lab1 only
 // read the pointer to the retaddr on the stack
 static uint32_t
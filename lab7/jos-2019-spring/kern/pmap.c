@@ -7,10 +7,12 @@
 #include <inc/assert.h>
 #include <kern/pmap.h>
 #include <kern/kclock.h>
+#include <kern/time.h>
 #include <kern/env.h>
 #include <kern/cpu.h>
 #include <inc/queue.h>
 #include <kern/kpti.h>
+#include <kern/spinlock.h>
 
 // These variables are set by i386_detect_memory()
 size_t npages;								// Amount of physical memory (in pages)
@@ -20,6 +22,61 @@ static size_t npages_basemem; // Amount of base memory (in pages)
 pde_t *kern_pgdir;											// Kernel's initial page directory
 struct PageInfo *pages;									// Physical page state array
 static struct PageInfo *page_free_list; // Free list of physical pages
+// After boot, free pages are kept by a buddy allocator instead:
+// page_free_area[k] lists the free blocks of 2^k pages, each aligned
+// to 2^k pages in physical memory.  The first page of a free block has
+// pp_order set and pp_pprev pointing at the link that points to it.
+static struct PageInfo *page_free_area[PAGE_MAX_ORDER + 1];
+static uint32_t page_nfree_area[PAGE_MAX_ORDER + 1]; // Blocks in each list
+static size_t page_nfree;														 // Free pages in page_free_area
+// Protects the free lists, page_nfree and every page's pp_ref
+static struct spinlock page_lock = SPINLOCK_INIT(page_lock);
+
+// Each CPU keeps a cache of free pages in front of the buddy allocator,
+// so most page_alloc and page_free calls don't take page_lock.  Pages
+// move between a cache and the buddy allocator PAGE_CACHE_BATCH at a
+// time.  A cache is almost always used by its own CPU only, so its
+// lock is uncontended; another CPU takes it only to reclaim the pages
+// when the buddy allocator runs dry.
+#define PAGE_CACHE_BATCH 16
+#define PAGE_CACHE_HIGH 64 // Drain a cache that grows past this
+
+struct PageCache
+{
+	struct spinlock pc_lock; // Protects pc_list and pc_count
+
+	// Most recently freed (hot) pages first, so page_alloc returns
+	// pages that are likely still in the CPU's caches, and draining
+	// gives back the cold ones at the tail.
+	struct PageInfo *pc_list;
+	int pc_count;
+
+	// Statistics, for page_print_stats
+	uint32_t pc_nalloc;	 // page_alloc calls
+	uint32_t pc_nhit;		 // ... served from the cache
+	uint32_t pc_nrefill; // Refills from the buddy allocator
+	uint32_t pc_ndrain;	 // Drains to the buddy allocator
+	uint32_t pc_nzero_hit;	// ALLOC_ZERO pages from the pre-zeroed pool
+	uint32_t pc_nzero_miss; // ... zeroed by page_alloc
+} __attribute__((aligned(64)));
+
+static struct PageCache page_caches[NCPU] = {
+		[0 ... NCPU - 1] = {.pc_lock = SPINLOCK_INIT(page_cache_lock)}};
+// Set once mem_init's checks, which expect every free page on
+// page_free_list, are done.  From then on free pages are in the buddy
+// allocator and the per-CPU caches.
+static bool page_buddy_on;
+
+// Free pages that idle CPUs have already zeroed, so page_alloc can
+// hand them out for ALLOC_ZERO without a memset.  They are not in the
+// buddy allocator, unless page_alloc_order needs them to merge blocks.
+#define PAGE_ZERO_BATCH 16 // Pages an idle CPU zeroes at a time
+#define PAGE_ZERO_HIGH 512 // Stop zeroing with this many in the pool
+
+static struct PageInfo *page_zero_list;
+static size_t page_nzero;
+// Protects page_zero_list and page_nzero
+static struct spinlock page_zero_lock = SPINLOCK_INIT(page_zero_lock);
 
 // --------------------------------------------------------------
 // Detect machine's physical memory setup.
@@ -64,6 +121,7 @@ i386_detect_memory(void)
 
 static void mem_init_mp(void);
 static void boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm);
+static void page_buddy_init(void);
 static void boot_map_region_large(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm);
 static void check_page_free_list(bool only_low_memory);
 static void check_page_alloc(void);
@@ -72,6 +130,7 @@ static physaddr_t check_va2pa(pde_t *pgdir, uintptr_t va);
 static physaddr_t check_va2pa_large(pde_t *pgdir, uintptr_t va);
 static void check_page(void);
 static void check_page_installed_pgdir(void);
+static void check_page_alloc_order(void);
 
 // This simple physical memory allocator is used only while JOS is setting
 // up its virtual memory system.  page_alloc() is the real allocator.
@@ -204,7 +263,15 @@ void mem_init(void)
 	//    - the new image at UENVS  -- kernel R, user R
 	//    - envs itself -- kernel RW, user NONE
 	// LAB 3: Your code here.
-	boot_map_region(kern_pgdir, UENVS, PTSIZE, PADDR(envs), PTE_U);
+	assert(UENVS + ROUNDUP(NENV * sizeof(struct Env), PGSIZE) <= UTIME);
+	boot_map_region(kern_pgdir, UENVS, ROUNDUP(NENV * sizeof(struct Env), PGSIZE),
+			PADDR(envs), PTE_U);
+
+	//////////////////////////////////////////////////////////////////////
+	// Map the kernel's time information read-only by the user at linear
+	// address UTIME, so that users can read the time without a system
+	// call (see struct TimeInfo).
+	boot_map_region(kern_pgdir, UTIME, PGSIZE, PADDR(timepage), PTE_U);
 	//////////////////////////////////////////////////////////////////////
 	// Use the physical memory that 'bootstack' refers to as the kernel
 	// stack.  The kernel stack grows down from virtual address KSTACKTOP.
@@ -260,6 +327,11 @@ void mem_init(void)
 	// Some more checks, only possible after kern_pgdir is installed.
 	check_page_installed_pgdir();
 
+	// From here on, page_alloc and page_free use the buddy allocator
+	// and the per-CPU caches.
+	page_buddy_init();
+	check_page_alloc_order();
+
 	cprintf("__USER_MAP_BEGIN__ = %08x\n", __USER_MAP_BEGIN__);
 	cprintf("__USER_MAP_END__ = %08x\n", __USER_MAP_END__);
 }
@@ -370,6 +442,299 @@ void page_init(void)
 	}
 }
 
+// Put the free block of 2^order pages at 'pp' on its free list.
+// With page_lock held.
+static void
+buddy_insert(struct PageInfo *pp, int order)
+{
+	pp->pp_order = order;
+	pp->pp_link = page_free_area[order];
+	if (pp->pp_link)
+		pp->pp_link->pp_pprev = &pp->pp_link;
+	pp->pp_pprev = &page_free_area[order];
+	page_free_area[order] = pp;
+	page_nfree_area[order]++;
+}
+
+// Take the free block at 'pp' off its free list.  With page_lock held.
+static void
+buddy_remove(struct PageInfo *pp)
+{
+	*pp->pp_pprev = pp->pp_link;
+	if (pp->pp_link)
+		pp->pp_link->pp_pprev = pp->pp_pprev;
+	page_nfree_area[pp->pp_order]--;
+	pp->pp_link = NULL;
+	pp->pp_pprev = NULL;
+}
+
+// Allocate a block of 2^order pages, splitting a bigger block if there
+// is no free block that size.  With page_lock held.
+static struct PageInfo *
+buddy_alloc(int order)
+{
+	struct PageInfo *pp;
+	int k;
+
+	for (k = order; k <= PAGE_MAX_ORDER && page_free_area[k] == NULL; k++)
+		;
+	if (k > PAGE_MAX_ORDER)
+		return NULL;
+
+	pp = page_free_area[k];
+	buddy_remove(pp);
+	// Give back the upper halves we don't need
+	while (k > order)
+	{
+		k--;
+		buddy_insert(pp + (1 << k), k);
+	}
+	page_nfree -= 1 << order;
+	return pp;
+}
+
+// Free the block of 2^order pages at 'pp', merging it with its buddy
+// for as long as the buddy is free too.  With page_lock held.
+static void
+buddy_free(struct PageInfo *pp, int order)
+{
+	size_t i = pp - pages, buddy;
+
+	page_nfree += 1 << order;
+	for (; order < PAGE_MAX_ORDER; order++)
+	{
+		buddy = i ^ (1 << order);
+		if (buddy >= npages || pages[buddy].pp_pprev == NULL ||
+				pages[buddy].pp_order != order)
+			break;
+		buddy_remove(&pages[buddy]);
+		i &= ~(1 << order);
+	}
+	buddy_insert(&pages[i], order);
+}
+
+// Hand every page on page_free_list to the buddy allocator, once the
+// boot-time checks are done with it.
+static void
+page_buddy_init(void)
+{
+	struct PageInfo *pp;
+
+	spin_lock(&page_lock);
+	page_nfree = 0;
+	while ((pp = page_free_list) != NULL)
+	{
+		page_free_list = pp->pp_link;
+		pp->pp_link = NULL;
+		buddy_free(pp, 0);
+	}
+	page_buddy_on = 1;
+	spin_unlock(&page_lock);
+}
+
+// Take a page from the pre-zeroed pool, or return NULL if it's empty.
+static struct PageInfo *
+page_zero_get(void)
+{
+	struct PageInfo *pp;
+
+	spin_lock(&page_zero_lock);
+	if ((pp = page_zero_list) != NULL)
+	{
+		page_zero_list = pp->pp_link;
+		page_nzero--;
+	}
+	spin_unlock(&page_zero_lock);
+	return pp;
+}
+
+// Would an idle CPU do well to call page_zero_idle?  Only a hint: it
+// reads the counters without locks.
+bool page_zero_wanted(void)
+{
+	return page_buddy_on && page_nzero < PAGE_ZERO_HIGH && page_nfree > 0;
+}
+
+// Move up to PAGE_ZERO_BATCH free pages from the buddy allocator to
+// the pre-zeroed pool, zeroing them with no locks held.  Called by
+// idle CPUs from sched_halt.
+void page_zero_idle(void)
+{
+	struct PageInfo *batch = NULL, *last = NULL, *pp;
+	int n = 0;
+
+	if (!page_zero_wanted())
+		return;
+
+	spin_lock(&page_lock);
+	while (n < PAGE_ZERO_BATCH && (pp = buddy_alloc(0)) != NULL)
+	{
+		pp->pp_link = batch;
+		batch = pp;
+		n++;
+	}
+	spin_unlock(&page_lock);
+
+	if (batch == NULL)
+		return;
+	for (pp = batch; pp; pp = pp->pp_link)
+	{
+		memset(page2kva(pp), '\0', PGSIZE);
+		last = pp;
+	}
+
+	spin_lock(&page_zero_lock);
+	last->pp_link = page_zero_list;
+	page_zero_list = batch;
+	page_nzero += n;
+	spin_unlock(&page_zero_lock);
+}
+
+// Move up to PAGE_CACHE_BATCH pages from the buddy allocator into
+// cache 'pc'.  With pc's lock held.
+static void
+page_cache_refill(struct PageCache *pc)
+{
+	struct PageInfo *pp;
+
+	spin_lock(&page_lock);
+	while (pc->pc_count < PAGE_CACHE_BATCH && (pp = buddy_alloc(0)) != NULL)
+	{
+		pp->pp_link = pc->pc_list;
+		pc->pc_list = pp;
+		pc->pc_count++;
+	}
+	spin_unlock(&page_lock);
+}
+
+// Give every page in every CPU's cache back to the buddy allocator,
+// so page_alloc doesn't fail while other CPUs hold free pages.
+static void
+page_cache_reclaim(void)
+{
+	struct PageCache *pc;
+	struct PageInfo *list, *pp;
+	int i;
+
+	for (i = 0; i < ncpu; i++)
+	{
+		pc = &page_caches[i];
+		spin_lock(&pc->pc_lock);
+		list = pc->pc_list;
+		pc->pc_list = NULL;
+		pc->pc_count = 0;
+		spin_unlock(&pc->pc_lock);
+
+		spin_lock(&page_lock);
+		while ((pp = list) != NULL)
+		{
+			list = pp->pp_link;
+			pp->pp_link = NULL;
+			buddy_free(pp, 0);
+		}
+		spin_unlock(&page_lock);
+	}
+}
+
+// Give every page in the pre-zeroed pool back to the buddy allocator,
+// so they can merge into blocks for page_alloc_order.
+static void
+page_zero_reclaim(void)
+{
+	struct PageInfo *list, *pp;
+
+	spin_lock(&page_zero_lock);
+	list = page_zero_list;
+	page_zero_list = NULL;
+	page_nzero = 0;
+	spin_unlock(&page_zero_lock);
+
+	spin_lock(&page_lock);
+	while ((pp = list) != NULL)
+	{
+		list = pp->pp_link;
+		pp->pp_link = NULL;
+		buddy_free(pp, 0);
+	}
+	spin_unlock(&page_lock);
+}
+
+// Take a page from cache 'pc', first refilling it from the buddy
+// allocator if it's empty.  When both are empty, fall back on the
+// pre-zeroed pool.  Returns NULL if there are no free pages at all.
+static struct PageInfo *
+page_cache_get(struct PageCache *pc)
+{
+	struct PageInfo *pp;
+
+	spin_lock(&pc->pc_lock);
+	pc->pc_nalloc++;
+	if (pc->pc_list == NULL)
+	{
+		pc->pc_nrefill++;
+		page_cache_refill(pc);
+		if (pc->pc_list == NULL)
+		{
+			// The last free pages may be in other CPUs' caches
+			spin_unlock(&pc->pc_lock);
+			page_cache_reclaim();
+			spin_lock(&pc->pc_lock);
+			page_cache_refill(pc);
+		}
+		if (pc->pc_list == NULL)
+		{
+			spin_unlock(&pc->pc_lock);
+			return page_zero_get();
+		}
+	}
+	else
+		pc->pc_nhit++;
+
+	pp = pc->pc_list;
+	pc->pc_list = pp->pp_link;
+	pc->pc_count--;
+	spin_unlock(&pc->pc_lock);
+	return pp;
+}
+
+// Put free page 'pp' at the head of cache 'pc'.  If that makes the
+// cache too big, give its PAGE_CACHE_BATCH coldest pages back to the
+// buddy allocator.
+static void
+page_cache_put(struct PageCache *pc, struct PageInfo *pp)
+{
+	struct PageInfo **tail, *cold;
+	int i;
+
+	spin_lock(&pc->pc_lock);
+	pp->pp_link = pc->pc_list;
+	pc->pc_list = pp;
+	if (++pc->pc_count <= PAGE_CACHE_HIGH)
+	{
+		spin_unlock(&pc->pc_lock);
+		return;
+	}
+
+	pc->pc_ndrain++;
+	tail = &pc->pc_list;
+	for (i = 0; i < pc->pc_count - PAGE_CACHE_BATCH; i++)
+		tail = &(*tail)->pp_link;
+	cold = *tail;
+	*tail = NULL;
+	pc->pc_count -= PAGE_CACHE_BATCH;
+	spin_unlock(&pc->pc_lock);
+
+	spin_lock(&page_lock);
+	while (cold)
+	{
+		pp = cold;
+		cold = pp->pp_link;
+		pp->pp_link = NULL;
+		buddy_free(pp, 0);
+	}
+	spin_unlock(&page_lock);
+}
+
 //
 // Allocates a physical page.  If (alloc_flags & ALLOC_ZERO), fills the entire
 // returned physical page with '\0' bytes.  Does NOT increment the reference
@@ -385,28 +750,49 @@ void page_init(void)
 struct PageInfo *
 page_alloc(int alloc_flags)
 {
-	if (page_free_list == NULL)
+	struct PageInfo *alloc_page;
+
+	if ((alloc_flags & ALLOC_ZERO) && (alloc_page = page_zero_get()) != NULL)
 	{
-		return NULL;
+		page_caches[cpunum()].pc_nzero_hit++;
+		alloc_page->pp_ref = 0;
+		alloc_page->pp_link = NULL;
+		return alloc_page;
 	}
 
-	struct PageInfo *alloc_page = page_free_list;
-	page_free_list = page_free_list->pp_link;
+	if (page_buddy_on)
+	{
+		alloc_page = page_cache_get(&page_caches[cpunum()]);
+		if (alloc_page == NULL)
+			return NULL;
+	}
+	else
+	{
+		spin_lock(&page_lock);
+		if (page_free_list == NULL)
+		{
+			spin_unlock(&page_lock);
+			return NULL;
+		}
+
+		alloc_page = page_free_list;
+		page_free_list = page_free_list->pp_link;
+		spin_unlock(&page_lock);
+	}
 
 	if (alloc_flags & ALLOC_ZERO)
 	{
 		memset(page2kva(alloc_page), '\0', PGSIZE);
+		page_caches[cpunum()].pc_nzero_miss++;
 	}
 	alloc_page->pp_ref = 0;
 	alloc_page->pp_link = NULL;
 	return alloc_page;
 }
 
-//
-// Return a page to the free list.
-// (This function should only be called when pp->pp_ref reaches 0.)
-//
-void page_free(struct PageInfo *pp)
+// page_free() with page_lock held.
+static void
+__page_free(struct PageInfo *pp)
 {
 	// Fill this function in
 	// Hint: You may want to panic if pp->pp_ref is nonzero or
@@ -419,16 +805,143 @@ void page_free(struct PageInfo *pp)
 	page_free_list = pp;
 }
 
+//
+// Return a page to the free list.
+// (This function should only be called when pp->pp_ref reaches 0.)
+//
+void page_free(struct PageInfo *pp)
+{
+	if (page_buddy_on)
+	{
+		if (pp->pp_ref != 0 || pp->pp_link != NULL)
+			panic("Page free error!\n");
+		page_cache_put(&page_caches[cpunum()], pp);
+		return;
+	}
+
+	spin_lock(&page_lock);
+	__page_free(pp);
+	spin_unlock(&page_lock);
+}
+
+//
+// Allocates 2^order physically contiguous pages, aligned to 2^order
+// pages, for things like DMA rings that don't fit in one page.  Like
+// page_alloc, it zeroes them if (alloc_flags & ALLOC_ZERO), and
+// leaves the reference counts at zero.  The pages must be given back
+// all at once with page_free_order.
+//
+// Returns NULL if there is no free block that big.
+//
+struct PageInfo *
+page_alloc_order(int order, int alloc_flags)
+{
+	struct PageInfo *pp;
+	int i;
+
+	assert(page_buddy_on);
+	if (order < 0 || order > PAGE_MAX_ORDER)
+		return NULL;
+
+	spin_lock(&page_lock);
+	pp = buddy_alloc(order);
+	spin_unlock(&page_lock);
+	if (pp == NULL)
+	{
+		// Pages in the per-CPU caches and the pre-zeroed pool may
+		// be what keeps blocks from merging: give them back and
+		// try again.
+		page_cache_reclaim();
+		page_zero_reclaim();
+		spin_lock(&page_lock);
+		pp = buddy_alloc(order);
+		spin_unlock(&page_lock);
+		if (pp == NULL)
+			return NULL;
+	}
+
+	if (alloc_flags & ALLOC_ZERO)
+		memset(page2kva(pp), '\0', PGSIZE << order);
+	for (i = 0; i < (1 << order); i++)
+	{
+		pp[i].pp_ref = 0;
+		pp[i].pp_link = NULL;
+	}
+	return pp;
+}
+
+//
+// Return the 2^order pages at 'pp' that page_alloc_order allocated.
+//
+void page_free_order(struct PageInfo *pp, int order)
+{
+	int i;
+
+	for (i = 0; i < (1 << order); i++)
+		if (pp[i].pp_ref != 0 || pp[i].pp_link != NULL)
+			panic("Page free error!\n");
+
+	spin_lock(&page_lock);
+	buddy_free(pp, order);
+	spin_unlock(&page_lock);
+}
+
 //
 // Decrement the reference count on a page,
 // freeing it if there are no more refs.
 //
 void page_decref(struct PageInfo *pp)
 {
-	if (--pp->pp_ref == 0)
+	bool last;
+
+	spin_lock(&page_lock);
+	last = --pp->pp_ref == 0;
+	spin_unlock(&page_lock);
+	// Nothing maps the page any more, so nobody can take a new
+	// reference to it before it's freed.
+	if (last)
 		page_free(pp);
 }
 
+// Print how many pages are free, and how well each CPU's page cache
+// is doing.
+void page_print_stats(void)
+{
+	int i;
+	size_t nfree = page_nfree + page_nzero;
+	struct PageCache *pc;
+
+	// Other CPUs' caches may change under us, but only a little
+	for (i = 0; i < ncpu; i++)
+		nfree += page_caches[i].pc_count;
+	cprintf("%u of %u pages free: %u zeroed, %u not zeroed (%u in the buddy allocator)\n",
+					nfree, npages, page_nzero, nfree - page_nzero, page_nfree);
+	cprintf("free blocks by order:");
+	for (i = 0; i <= PAGE_MAX_ORDER; i++)
+		cprintf(" %u", page_nfree_area[i]);
+	cprintf("\n");
+	cprintf("cpu  cached   allocs     hits  hit%%  refills   drains  prezeroed  memset\n");
+	for (i = 0; i < ncpu; i++)
+	{
+		pc = &page_caches[i];
+		cprintf("%3d  %6d  %7u  %7u  %4u  %7u  %7u  %9u  %6u\n", i, pc->pc_count,
+						pc->pc_nalloc, pc->pc_nhit,
+						pc->pc_nalloc ? (uint32_t)((uint64_t)pc->pc_nhit * 100 / pc->pc_nalloc) : 0,
+						pc->pc_nrefill, pc->pc_ndrain, pc->pc_nzero_hit, pc->pc_nzero_miss);
+	}
+}
+
+//
+// Increment the reference count on a page that may be mapped
+// elsewhere, so another CPU may be changing it too.
+//
+void page_incref(struct PageInfo *pp)
+{
+	spin_lock(&page_lock);
+	pp->pp_ref++;
+	spin_unlock(&page_lock);
+}
+
 // Given 'pgdir', a pointer to a page directory, pgdir_walk returns
 // a pointer to the page table entry (PTE) for linear address 'va'.
 // This requires walking the two-level page table structure.
@@ -565,7 +1078,7 @@ int page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm)
 	{
 		return -E_NO_MEM;
 	}
-	pp->pp_ref++;
+	page_incref(pp);
 	if (*pte && PTE_P)
 	{
 		page_remove(pgdir, va);
@@ -937,6 +1450,9 @@ check_kern_pgdir(void)
 	for (i = 0; i < n; i += PGSIZE)
 		assert(check_va2pa(pgdir, UENVS + i) == PADDR(envs) + i);
 
+	// check time information page
+	assert(check_va2pa(pgdir, UTIME) == PADDR(timepage));
+
 	// check phys mem
 	if (check_va2pa_large(pgdir, KERNBASE) == 0)
 	{
@@ -1235,3 +1751,56 @@ check_page_installed_pgdir(void)
 	cprintf("check_page_installed_pgdir() succeeded!\n");
 }
 
+
+// check page_alloc_order and page_free_order
+static void
+check_page_alloc_order(void)
+{
+	struct PageInfo *pp0, *pp1, *list;
+	size_t nfree, n;
+	int i;
+
+	spin_lock(&page_lock);
+	nfree = page_nfree;
+	spin_unlock(&page_lock);
+
+	// blocks are aligned to their size and zeroed on request
+	assert((pp0 = page_alloc_order(3, ALLOC_ZERO)));
+	assert((pp0 - pages) % 8 == 0);
+	for (i = 0; i < 8 * PGSIZE; i++)
+		assert(((char *)page2kva(pp0))[i] == 0);
+	assert((pp1 = page_alloc_order(0, 0)));
+	assert(pp1 < pp0 || pp1 >= pp0 + 8);
+	assert(!page_alloc_order(PAGE_MAX_ORDER + 1, 0));
+
+	// freeing them gives every page back
+	page_free_order(pp1, 0);
+	page_free_order(pp0, 3);
+	spin_lock(&page_lock);
+	assert(page_nfree == nfree);
+	spin_unlock(&page_lock);
+
+	// with a full pre-zeroed pool, page_alloc_order can still get at
+	// every free page
+	while (page_zero_wanted())
+		page_zero_idle();
+	assert(page_nzero > 0);
+	page_cache_reclaim();
+	nfree = page_nfree + page_nzero;
+	for (list = NULL, n = 0; (pp0 = page_alloc_order(0, 0)); n++)
+	{
+		pp0->pp_link = list;
+		list = pp0;
+	}
+	assert(n == nfree);
+	assert(page_nzero == 0);
+	while ((pp0 = list) != NULL)
+	{
+		list = pp0->pp_link;
+		pp0->pp_link = NULL;
+		page_free_order(pp0, 0);
+	}
+	assert(page_nfree == nfree);
+
+	cprintf("check_page_alloc_order() succeeded!\n");
+}
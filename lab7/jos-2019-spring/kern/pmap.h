@@ -51,15 +51,24 @@ enum {
 	ALLOC_ZERO = 1<<0,
 };
 
+// The biggest block page_alloc_order hands out is 2^PAGE_MAX_ORDER pages.
+#define PAGE_MAX_ORDER 10
+
 void	mem_init(void);
 
 void	page_init(void);
 struct PageInfo *page_alloc(int alloc_flags);
 void	page_free(struct PageInfo *pp);
+struct PageInfo *page_alloc_order(int order, int alloc_flags);
+void	page_free_order(struct PageInfo *pp, int order);
 int	page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm);
 void	page_remove(pde_t *pgdir, void *va);
 struct PageInfo *page_lookup(pde_t *pgdir, void *va, pte_t **pte_store);
 void	page_decref(struct PageInfo *pp);
+void	page_incref(struct PageInfo *pp);
+void	page_print_stats(void);
+bool	page_zero_wanted(void);
+void	page_zero_idle(void);
 
 void	tlb_invalidate(pde_t *pgdir, void *va);
 
@@ -4,81 +4,967 @@
 #include <kern/env.h>
 #include <kern/pmap.h>
 #include <kern/monitor.h>
+#include <kern/sched.h>
+#include <kern/time.h>
 
-void sched_halt(void);
+#ifndef SCHED_CFS
+// Multi-level feedback queue.
+//
+// An environment's current level, env_prio, starts at its base level
+// env_prio_base.  Each level gets a time slice of SLICE_MSEC(level);
+// an environment that uses up its slice sinks one level.  An
+// environment that blocks (in IPC, or because someone set it
+// ENV_NOT_RUNNABLE) and is woken up again goes back to its base level,
+// and every BOOST_MSEC all environments are lifted back to their base
+// level so CPU-bound work at the bottom can't starve.
+#define SLICE_MSEC(prio)	(TICK_MSEC << (prio))
+#define BOOST_MSEC		1000
+#else
+// Virtual runtime.
+//
+// An environment's env_vruntime grows as it runs, more slowly the
+// higher its weight, and each CPU runs the queued environment with
+// the smallest vruntime.  The weight of ENV_PRIO_NORMAL is 1024 and
+// each level above it doubles it.  Every LATENCY_MSEC is split between
+// the environments on a CPU, but nobody gets less than MIN_SLICE_MSEC
+// at a time.
+//
+// While an environment is queued or running on a CPU, its vruntime is
+// on that CPU's clock, rq_min_vruntime, which only moves forward.  An
+// environment that blocks keeps its vruntime relative to the clock as
+// a lag, and when it wakes it gets at most WAKE_BONUS_USEC of credit.
+#define WEIGHT(prio)		(2048 >> (prio))
+#define LATENCY_MSEC		20
+#define MIN_SLICE_MSEC		2
+#define WAKE_BONUS_USEC		(LATENCY_MSEC * 1000 / 2)
+// A newly queued environment preempts the running one if its vruntime
+// is at least this much smaller.
+#define WAKE_GRAN_USEC		1000
+#endif
 
-// Choose a user environment to run and run it.
-void sched_yield(void)
+// With TICKLESS, the timer is armed for the end of the running
+// environment's slice.  An idle CPU sleeps for IDLE_MSEC before
+// looking for work to steal.
+#define IDLE_MSEC		100
+
+// Per-CPU queues of ENV_RUNNABLE environments: with the MLFQ, one FIFO
+// per level, and with SCHED_CFS, a binary min-heap on env_vruntime.
+// An environment is on exactly one run queue iff its status is
+// ENV_RUNNABLE; sched_set_status() maintains that invariant.
+//
+// Each CPU only ever runs environments from its own queue.  Work moves
+// between CPUs when a new or woken environment is placed on the least
+// loaded CPU, and when a CPU steals from the busiest one in
+// runq_balance().
+struct RunQueue
 {
-	struct Env *idle;
+#ifndef SCHED_CFS
+	struct Env *rq_head[NPRIO];
+	struct Env *rq_tail[NPRIO];
+#else
+	struct Env *rq_heap[NENV];
+	int64_t rq_min_vruntime;
+#endif
+	uint32_t rq_len;
 
-	// Implement simple round-robin scheduling.
-	//
-	// Search through 'envs' for an ENV_RUNNABLE environment in
-	// circular fashion starting just after the env this CPU was
-	// last running.  Switch to the first such environment found.
-	//
-	// If no envs are runnable, but the environment previously
-	// running on this CPU is still ENV_RUNNING, it's okay to
-	// choose that environment. Make sure curenv is not null before
-	// dereferencing it.
-	//
-	// Never choose an environment that's currently running on
-	// another CPU (env_status == ENV_RUNNING). If there are
-	// no runnable environments, simply drop through to the code
-	// below to halt the cpu.
+	// Time slice of the environment this CPU is running, in time_msec()
+	unsigned int rq_slice_start;
+	unsigned int rq_slice_end;
+	// time_usec() the running environment has been charged up to
+	uint64_t rq_charged;
+	// Milliseconds of slice handed over by sched_yield_to()
+	uint32_t rq_donated;
+
+	// Statistics, shown by the 'sched' monitor command
+	uint32_t rq_nticks;	// Timer interrupts taken
+	uint32_t rq_nrun;	// Environments this CPU switched to
+	uint32_t rq_npulled;	// Environments stolen from other CPUs
+	uint32_t rq_npushed;	// Environments stolen by other CPUs
+	uint32_t rq_nhandoff;	// Directed yields taken by sched_yield_to
+	uint32_t rq_nipisent;	// Reschedule IPIs sent to other CPUs
+	uint32_t rq_nipirecv;	// Reschedule IPIs received
+
+	// A reschedule IPI to this CPU is on its way
+	bool rq_kicked;
+};
+
+static struct RunQueue runqs[NCPU];
+
+// Number of environments that are ENV_RUNNABLE, ENV_RUNNING or
+// ENV_DYING, so sched_halt() can tell without scanning 'envs'.
+static uint32_t sched_nactive;
+
+#ifndef SCHED_CFS
+// time_msec() of the last priority boost
+static unsigned int sched_last_boost;
+#endif
+
+// Protects everything in this file, and the env_status, env_cpunum
+// and scheduling fields of every environment.  Every CPU's curenv is
+// only changed with it held, in sched_run() and sched_halt().
+static struct spinlock sched_lock = SPINLOCK_INIT(sched_lock);
+
+// Environments blocked in sys_sleep_until(), sorted by env_wakeup.
+// A sleeping environment is ENV_NOT_RUNNABLE, so the scheduler never
+// looks at it; sched_tick() wakes the ones whose time has come.
+static struct Env *sleepq;
+static uint32_t sched_nsleeping;
+
+void sched_halt(void) __attribute__((noreturn));
+static void __sched_set_status(struct Env *e, unsigned status);
+
+static bool
+cpu_allowed(struct Env *e, int cpu)
+{
+	return e->env_affinity & (1 << cpu);
+}
+
+// The environment CPU 'cpu' is running, if any.  A CPU's cpu_env can
+// be stale: an environment that blocked in a system call on this CPU
+// may have been woken and picked up by another CPU before this one got
+// around to choosing something else to run.
+static struct Env *
+cpu_curenv(int cpu)
+{
+	struct Env *e = cpus[cpu].cpu_env;
+
+	if (e && e->env_status == ENV_RUNNING && e->env_cpunum == cpu)
+		return e;
+	return NULL;
+}
+
+#ifndef SCHED_CFS
+
+static void
+runq_push(int cpu, struct Env *e)
+{
+	struct RunQueue *rq = &runqs[cpu];
+	int prio = e->env_prio;
+
+	assert(e->env_rq_cpu < 0);
+	e->env_rq_next = NULL;
+	e->env_rq_prev = rq->rq_tail[prio];
+	if (rq->rq_tail[prio])
+		rq->rq_tail[prio]->env_rq_next = e;
+	else
+		rq->rq_head[prio] = e;
+	rq->rq_tail[prio] = e;
+	rq->rq_len++;
+	e->env_rq_cpu = cpu;
+}
+
+static void
+runq_remove(struct Env *e)
+{
+	struct RunQueue *rq = &runqs[e->env_rq_cpu];
+	int prio = e->env_prio;
+
+	if (e->env_rq_prev)
+		e->env_rq_prev->env_rq_next = e->env_rq_next;
+	else
+		rq->rq_head[prio] = e->env_rq_next;
+	if (e->env_rq_next)
+		e->env_rq_next->env_rq_prev = e->env_rq_prev;
+	else
+		rq->rq_tail[prio] = e->env_rq_prev;
+	rq->rq_len--;
+	e->env_rq_next = e->env_rq_prev = NULL;
+	e->env_rq_cpu = -1;
+}
+
+// The environment 'cpu' should run next: the head of its highest
+// non-empty level.
+static struct Env *
+runq_first(int cpu)
+{
+	int prio;
+
+	for (prio = 0; prio < NPRIO; prio++)
+		if (runqs[cpu].rq_head[prio])
+			return runqs[cpu].rq_head[prio];
+	return NULL;
+}
+
+// The environment queued on 'cpu' that 'cpu' would get to last, among
+// those that may run on 'thief'.
+static struct Env *
+runq_last(int cpu, int thief)
+{
+	struct Env *e;
+	int prio;
+
+	for (prio = NPRIO - 1; prio >= 0; prio--)
+		for (e = runqs[cpu].rq_tail[prio]; e; e = e->env_rq_prev)
+			if (cpu_allowed(e, thief))
+				return e;
+	return NULL;
+}
+
+// True if e should run before 'cur'.
+static bool
+runq_before(struct Env *e, struct Env *cur)
+{
+	return e->env_prio < cur->env_prio;
+}
+
+// Length of e's next time slice on 'cpu', in milliseconds.
+static uint32_t
+runq_slice(int cpu, struct Env *e)
+{
+	uint32_t len = SLICE_MSEC(e->env_prio);
+
+	return e->env_slice_used < len ? len - e->env_slice_used : 0;
+}
+
+#else // SCHED_CFS
+
+static void
+heap_set(struct RunQueue *rq, int i, struct Env *e)
+{
+	rq->rq_heap[i] = e;
+	e->env_rq_slot = i;
+}
+
+// Restore the heap order around slot i.
+static void
+heap_fix(struct RunQueue *rq, int i)
+{
+	struct Env *e = rq->rq_heap[i];
+	int child;
+
+	while (i > 0 && rq->rq_heap[(i - 1) / 2]->env_vruntime > e->env_vruntime)
+	{
+		heap_set(rq, i, rq->rq_heap[(i - 1) / 2]);
+		i = (i - 1) / 2;
+	}
+	while ((child = 2 * i + 1) < rq->rq_len)
+	{
+		if (child + 1 < rq->rq_len &&
+				rq->rq_heap[child + 1]->env_vruntime < rq->rq_heap[child]->env_vruntime)
+			child++;
+		if (rq->rq_heap[child]->env_vruntime >= e->env_vruntime)
+			break;
+		heap_set(rq, i, rq->rq_heap[child]);
+		i = child;
+	}
+	heap_set(rq, i, e);
+}
+
+static void
+runq_push(int cpu, struct Env *e)
+{
+	struct RunQueue *rq = &runqs[cpu];
+
+	assert(e->env_rq_cpu < 0);
+	heap_set(rq, rq->rq_len++, e);
+	heap_fix(rq, e->env_rq_slot);
+	e->env_rq_cpu = cpu;
+}
+
+static void
+runq_remove(struct Env *e)
+{
+	struct RunQueue *rq = &runqs[e->env_rq_cpu];
+	int i = e->env_rq_slot;
+
+	if (i != --rq->rq_len)
+	{
+		heap_set(rq, i, rq->rq_heap[rq->rq_len]);
+		heap_fix(rq, i);
+	}
+	e->env_rq_slot = -1;
+	e->env_rq_cpu = -1;
+}
+
+// The environment 'cpu' should run next: the one with the smallest
+// vruntime.
+static struct Env *
+runq_first(int cpu)
+{
+	return runqs[cpu].rq_len ? runqs[cpu].rq_heap[0] : NULL;
+}
+
+// The environment queued on 'cpu' with the largest vruntime, among
+// those that may run on 'thief'.
+static struct Env *
+runq_last(int cpu, int thief)
+{
+	struct RunQueue *rq = &runqs[cpu];
+	struct Env *e, *last = NULL;
+	int i;
+
+	for (i = 0; i < rq->rq_len; i++)
+	{
+		e = rq->rq_heap[i];
+		if (cpu_allowed(e, thief) &&
+				(!last || e->env_vruntime > last->env_vruntime))
+			last = e;
+	}
+	return last;
+}
+
+// True if e should run before 'cur'.
+static bool
+runq_before(struct Env *e, struct Env *cur)
+{
+	return e->env_vruntime + WAKE_GRAN_USEC < cur->env_vruntime;
+}
+
+// Length of e's next time slice on 'cpu', in milliseconds.
+static uint32_t
+runq_slice(int cpu, struct Env *e)
+{
+	uint32_t len = LATENCY_MSEC / (runqs[cpu].rq_len + 1);
+
+	return len > MIN_SLICE_MSEC ? len : MIN_SLICE_MSEC;
+}
+
+// Move CPU 'cpu''s clock up to the smallest vruntime on it.
+static void
+vruntime_update_min(int cpu)
+{
+	struct RunQueue *rq = &runqs[cpu];
+	struct Env *cur = cpu_curenv(cpu);
+	int64_t v;
+
+	if (cur)
+	{
+		v = cur->env_vruntime;
+		if (rq->rq_len && rq->rq_heap[0]->env_vruntime < v)
+			v = rq->rq_heap[0]->env_vruntime;
+	}
+	else if (rq->rq_len)
+		v = rq->rq_heap[0]->env_vruntime;
+	else
+		return;
+	if (v > rq->rq_min_vruntime)
+		rq->rq_min_vruntime = v;
+}
+
+// Put e's vruntime on CPU 'to''s clock, or make it a lag if 'to' is
+// -1.  'from' is the CPU whose clock it is on now, or -1 if it is a
+// lag.
+static void
+vruntime_move(struct Env *e, int from, int to)
+{
+	if (from >= 0)
+		e->env_vruntime -= runqs[from].rq_min_vruntime;
+	else if (e->env_vruntime < -WAKE_BONUS_USEC)
+		e->env_vruntime = -WAKE_BONUS_USEC;
+	if (to >= 0)
+		e->env_vruntime += runqs[to].rq_min_vruntime;
+}
+
+#endif // SCHED_CFS
+
+static bool
+status_is_active(unsigned status)
+{
+	return status == ENV_RUNNABLE || status == ENV_RUNNING ||
+				 status == ENV_DYING;
+}
+
+// Charge e, running on 'cpu', for the time since it was last charged.
+static void
+runtime_charge(int cpu, struct Env *e)
+{
+	uint64_t now = time_usec();
+	uint64_t delta = now - runqs[cpu].rq_charged;
+
+	runqs[cpu].rq_charged = now;
+	e->env_runtime += delta;
+#ifdef SCHED_CFS
+	e->env_vruntime += delta * WEIGHT(ENV_PRIO_NORMAL) / WEIGHT(e->env_prio_base);
+	vruntime_update_min(cpu);
+#endif
+}
+
+#ifndef SCHED_CFS
+// Move e back to its base level.
+static void
+prio_reset(struct Env *e)
+{
+	int cpu = e->env_rq_cpu;
+
+	if (cpu >= 0)
+		runq_remove(e);
+	e->env_prio = e->env_prio_base;
+	e->env_slice_used = 0;
+	if (cpu >= 0)
+		runq_push(cpu, e);
+}
+#endif
+
+// Start e's time slice on 'cpu', picking up where it left off.  If
+// the previous environment handed the CPU to e with sched_yield_to(),
+// e gets the rest of that environment's slice if it is longer.
+static void
+slice_start(int cpu, struct Env *e, unsigned int now)
+{
+	uint32_t len = runq_slice(cpu, e);
+
+	if (runqs[cpu].rq_donated > len)
+		len = runqs[cpu].rq_donated;
+	runqs[cpu].rq_donated = 0;
+	runqs[cpu].rq_slice_start = now;
+	runqs[cpu].rq_slice_end = now + len;
+}
+
+// Program this CPU's timer for its next deadline: the end of curenv's
+// time slice, or IDLE_MSEC from now if there is no curenv, or the
+// first sleeping environment's wakeup if that is sooner.  Every CPU
+// watches the sleep queue, so the CPU that put an environment to
+// sleep is always armed for it.
+static void
+timer_arm(unsigned int now)
+{
+#ifdef TICKLESS
+	uint32_t left = IDLE_MSEC, until;
+	int32_t slice;
+
+	if (cpu_curenv(cpunum()))
+	{
+		slice = runqs[cpunum()].rq_slice_end - now;
+		left = slice > 0 ? slice : 0;
+	}
+	if (sleepq)
+	{
+		until = sleepq->env_wakeup > now ? sleepq->env_wakeup - now : 0;
+		if (until < left)
+			left = until;
+	}
+	lapic_timer_oneshot(left);
+#endif
+}
+
+static void
+sleep_remove(struct Env *e)
+{
+	struct Env **pp;
+
+	for (pp = &sleepq; *pp != e; pp = &(*pp)->env_sleep_next)
+		assert(*pp);
+	*pp = e->env_sleep_next;
+	e->env_sleep_next = NULL;
+	e->env_sleeping = 0;
+	sched_nsleeping--;
+}
+
+// Wake every sleeping environment whose wakeup time has passed.
+static void
+sleep_wake(unsigned int now)
+{
+	struct Env *e;
 
-	// LAB 4: Your code here.
-	if (thiscpu->cpu_env == NULL)
+	while ((e = sleepq) && e->env_wakeup <= now)
 	{
-		for (envid_t i = 0; i < NENV; i++)
+		sleepq = e->env_sleep_next;
+		e->env_sleep_next = NULL;
+		e->env_sleeping = 0;
+		sched_nsleeping--;
+		__sched_set_status(e, ENV_RUNNABLE);
+	}
+}
+
+// Number of environments CPU 'cpu' is responsible for: the ones on its
+// run queue plus the one it is running, if any.
+static uint32_t
+runq_load(int cpu)
+{
+	return runqs[cpu].rq_len + (cpu_curenv(cpu) != NULL);
+}
+
+// Pick the run queue for an environment that just became runnable,
+// among the CPUs in its affinity mask.  The current environment stays
+// where it is.  Anything else goes back to the CPU it last ran on,
+// where its cache and TLB may still be warm, unless that CPU has at
+// least two more environments than the least loaded one; then it
+// goes to the least loaded CPU, preferring this one on ties.  A
+// halted CPU is as good as any idle one: sched_preempt() wakes it.
+static int
+runq_select(struct Env *e)
+{
+	int cpu = cpunum();
+	int i, best = -1;
+
+	if (e == curenv && cpu_allowed(e, cpu))
+		return cpu;
+	for (i = 0; i < ncpu; i++)
+		if (cpu_allowed(e, i) &&
+				(best < 0 || runq_load(i) < runq_load(best) ||
+				 (i == cpu && runq_load(i) == runq_load(best))))
+			best = i;
+	assert(best >= 0);
+
+	i = e->env_cpunum;
+	if (i >= 0 && i < ncpu && cpu_allowed(e, i) &&
+			runq_load(i) <= runq_load(best) + 1)
+		return i;
+	return best;
+}
+
+// Move queued environment e to CPU 'cpu''s run queue.
+static void
+runq_move(struct Env *e, int cpu)
+{
+#ifdef SCHED_CFS
+	int from = e->env_rq_cpu;
+#endif
+
+	runq_remove(e);
+#ifdef SCHED_CFS
+	vruntime_move(e, from, cpu);
+#endif
+	runq_push(cpu, e);
+}
+
+// Send CPU 'cpu' a reschedule IPI, unless one is already on its way.
+static void
+sched_kick(int cpu)
+{
+	if (runqs[cpu].rq_kicked)
+		return;
+	runqs[cpu].rq_kicked = 1;
+	runqs[cpunum()].rq_nipisent++;
+	lapic_ipi_cpu(cpu, IRQ_OFFSET + IRQ_RESCHED);
+}
+
+// e was just queued.  Make its CPU reschedule if it is halted in
+// sched_halt() or e should preempt the environment it is running,
+// instead of waiting for its next timer interrupt.  For this CPU, make
+// the timer fire as soon as we return to user mode; for any other CPU,
+// send it a reschedule IPI.
+static void
+sched_preempt(struct Env *e)
+{
+	int cpu = e->env_rq_cpu;
+	struct Env *cur = cpu_curenv(cpu);
+
+	if (cpu == cpunum())
+	{
+#ifdef TICKLESS
+		if (!cur)
+			return;
+		runtime_charge(cpu, cur);
+		if (runq_before(e, cur))
+			lapic_timer_oneshot(0);
+#endif
+		return;
+	}
+	if (cpus[cpu].cpu_status == CPU_HALTED || (cur && runq_before(e, cur)))
+		sched_kick(cpu);
+}
+
+// sched_set_status() with sched_lock held.
+static void
+__sched_set_status(struct Env *e, unsigned status)
+{
+	unsigned old = e->env_status;
+	int cpu = -1, to;
+
+	// A dying environment only goes on to be freed, even if the CPU
+	// running it gets to block it before it notices.
+	if (old == status || (old == ENV_DYING && status != ENV_FREE))
+		return;
+
+	// The CPU e is queued or running on, if any
+	if (old == ENV_RUNNABLE)
+		cpu = e->env_rq_cpu;
+	if (old == ENV_RUNNING)
+		cpu = e->env_cpunum;
+
+	if (old == ENV_RUNNABLE)
+		runq_remove(e);
+	if (old == ENV_NOT_RUNNABLE && e->env_sleeping)
+		sleep_remove(e);
+	if (old == ENV_RUNNING)
+	{
+		runtime_charge(cpu, e);
+		e->env_slice_used += time_msec() - runqs[cpu].rq_slice_start;
+	}
+	if (status_is_active(old))
+		sched_nactive--;
+
+	e->env_status = status;
+
+	if (status == ENV_RUNNABLE)
+	{
+		to = runq_select(e);
+#ifndef SCHED_CFS
+		// Newly created and woken environments start over at
+		// their base level.
+		if (old == ENV_FREE || old == ENV_NOT_RUNNABLE)
 		{
-			if (envs[i].env_status == ENV_RUNNABLE)
+			e->env_prio = e->env_prio_base;
+			e->env_slice_used = 0;
+		}
+#else
+		// Newly created environments start at the clock of the
+		// CPU they are queued on.
+		if (old == ENV_FREE)
+			e->env_vruntime = 0;
+		vruntime_move(e, cpu, to);
+#endif
+		runq_push(to, e);
+		e->env_wait_start = time_usec();
+		sched_preempt(e);
+	}
+	else if (status == ENV_RUNNING)
+	{
+		uint64_t now = time_usec();
+
+		// Only sched_run() makes an environment ENV_RUNNING, on
+		// this CPU, after setting curenv.
+		if (now - e->env_wait_start > e->env_max_wait)
+			e->env_max_wait = now - e->env_wait_start;
+		runqs[cpunum()].rq_charged = now;
+		slice_start(cpunum(), e, time_msec());
+		timer_arm(time_msec());
+	}
+#ifdef SCHED_CFS
+	else if (cpu >= 0)
+		// Off the CPUs: keep the vruntime as a lag
+		vruntime_move(e, cpu, -1);
+#endif
+	if (status_is_active(status))
+		sched_nactive++;
+
+	// curenv is blocking or dying on this CPU.  As soon as we drop
+	// sched_lock another CPU may wake it, or free it and its page
+	// tables, so stop using them.
+	if (e == curenv && old == ENV_RUNNING && status != ENV_RUNNABLE)
+		lcr3(PADDR(kern_pgdir));
+}
+
+// Change e's status to 'status', moving it on or off the run queues.
+// Every env_status update must go through here.
+void sched_set_status(struct Env *e, unsigned status)
+{
+	spin_lock(&sched_lock);
+	__sched_set_status(e, status);
+	spin_unlock(&sched_lock);
+}
+
+// Mark e ENV_DYING, to be destroyed.  Returns true if the caller
+// should free it now.  Returns false if another CPU is running it,
+// which will free it the next time it enters the kernel, or if it is
+// already dying.  Called with env_lock held.
+bool sched_set_dying(struct Env *e)
+{
+	bool free, elsewhere;
+
+	spin_lock(&sched_lock);
+	elsewhere = e->env_status == ENV_RUNNING && e != cpu_curenv(cpunum());
+	free = e->env_status != ENV_DYING && !elsewhere;
+	__sched_set_status(e, ENV_DYING);
+	// Get it into the kernel now rather than at its next timer
+	// interrupt.
+	if (elsewhere)
+		sched_kick(e->env_cpunum);
+	spin_unlock(&sched_lock);
+	return free;
+}
+
+// Block e until time_msec() reaches 'wakeup'.  Setting e's status
+// some other way, or destroying it, takes it off the sleep queue.
+void sched_sleep(struct Env *e, unsigned int wakeup)
+{
+	struct Env **pp;
+
+	spin_lock(&sched_lock);
+	__sched_set_status(e, ENV_NOT_RUNNABLE);
+	for (pp = &sleepq; *pp && (*pp)->env_wakeup <= wakeup;
+			 pp = &(*pp)->env_sleep_next)
+		;
+	e->env_wakeup = wakeup;
+	e->env_sleep_next = *pp;
+	e->env_sleeping = 1;
+	*pp = e;
+	sched_nsleeping++;
+	spin_unlock(&sched_lock);
+}
+
+// Set e's base priority and move it there.  With SCHED_CFS this
+// changes how fast its vruntime grows from now on.
+void sched_set_priority(struct Env *e, int prio)
+{
+	assert(prio >= 0 && prio < NPRIO);
+	spin_lock(&sched_lock);
+	if (e->env_status == ENV_RUNNING)
+		runtime_charge(e->env_cpunum, e);
+	e->env_prio_base = prio;
+#ifndef SCHED_CFS
+	prio_reset(e);
+#endif
+	spin_unlock(&sched_lock);
+}
+
+// Restrict e to the CPUs in 'mask'.  If e is queued on a CPU that is
+// no longer allowed, move it.  If it is running on one, it moves the
+// next time that CPU goes through sched_yield().
+void sched_set_affinity(struct Env *e, uint32_t mask)
+{
+	spin_lock(&sched_lock);
+	e->env_affinity = mask;
+	if (e->env_rq_cpu >= 0 && !cpu_allowed(e, e->env_rq_cpu))
+		runq_move(e, runq_select(e));
+	spin_unlock(&sched_lock);
+}
+
+// Steal runnable environments from the busiest CPU until the load
+// between it and this CPU differs by at most one.  Environments are
+// taken from the ones the victim would get to last.  Environments
+// whose affinity mask excludes this CPU are left alone.
+static void
+runq_balance(int cpu)
+{
+	struct Env *e;
+	int i, busiest = -1;
+
+	for (i = 0; i < ncpu; i++)
+		if (i != cpu && runqs[i].rq_len &&
+				(busiest < 0 || runq_load(i) > runq_load(busiest)))
+			busiest = i;
+	if (busiest < 0)
+		return;
+
+	while (runq_load(busiest) >= runq_load(cpu) + 2 &&
+				 (e = runq_last(busiest, cpu)) != NULL)
+	{
+		runq_move(e, cpu);
+		runqs[busiest].rq_npushed++;
+		runqs[cpu].rq_npulled++;
+	}
+}
+
+#ifndef SCHED_CFS
+// Lift every environment back to its base level.
+static void
+sched_boost(void)
+{
+	struct Env *e, *next;
+	int cpu, prio;
+
+	for (cpu = 0; cpu < ncpu; cpu++)
+	{
+		for (prio = 1; prio < NPRIO; prio++)
+			for (e = runqs[cpu].rq_head[prio]; e; e = next)
 			{
-				env_run(&envs[i]);
+				// prio_reset() pushes e back on the tail of its
+				// base level, which may be this very list, so
+				// leave environments already at their base level
+				// where they are or the walk never ends.
+				next = e->env_rq_next;
+				if (e->env_prio == e->env_prio_base)
+					e->env_slice_used = 0;
+				else
+					prio_reset(e);
 			}
+		if ((e = cpu_curenv(cpu)))
+		{
+			prio_reset(e);
+			slice_start(cpu, e, time_msec());
 		}
 	}
+}
+#endif
+
+// Called on every timer interrupt.  Returns true if this CPU should
+// reschedule: it is idle, the current environment used up its time
+// slice and something else is waiting for the CPU, or something that
+// should run first is waiting.  Otherwise re-arms the timer, so a CPU
+// running a single environment just keeps running it.
+bool sched_tick(void)
+{
+	int cpu = cpunum();
+	unsigned int now = time_msec();
+	struct Env *e, *cur;
+	bool resched;
+
+	spin_lock(&sched_lock);
+	runqs[cpu].rq_nticks++;
+	sleep_wake(now);
+#ifndef SCHED_CFS
+	if (cpu == 0 && now - sched_last_boost >= BOOST_MSEC)
+	{
+		sched_boost();
+		sched_last_boost = now;
+	}
+#endif
+
+	cur = cpu_curenv(cpu);
+	if (!cur || !cpu_allowed(cur, cpu))
+		resched = true;
 	else
 	{
-		envid_t current_env = ENVX(thiscpu->cpu_env->env_id);
-		assert(current_env >= 0);
-		for (envid_t i = 1; i < NENV; i++)
+		runtime_charge(cpu, cur);
+		if ((int32_t)(now - runqs[cpu].rq_slice_end) >= 0)
 		{
-			envid_t next_env = (current_env + i) % NENV;
-			if (envs[next_env].env_status == ENV_RUNNABLE)
-			{
-				env_run(&envs[next_env]);
-			}
+#ifndef SCHED_CFS
+			// Sink one level and start a new slice there.  cur is
+			// running, so it is not on a run queue.
+			if (cur->env_prio < NPRIO - 1)
+				cur->env_prio++;
+#endif
+			cur->env_slice_used = 0;
+			slice_start(cpu, cur, now);
+			runq_balance(cpu);
+			resched = runq_first(cpu) != NULL;
 		}
-		if (curenv->env_status == ENV_RUNNING)
+		else
+			resched = (e = runq_first(cpu)) && runq_before(e, cur);
+		timer_arm(now);
+	}
+	spin_unlock(&sched_lock);
+	return resched;
+}
+
+// Called on a reschedule IPI.  Returns true if this CPU should
+// reschedule, like sched_tick().
+bool sched_ipi(void)
+{
+	int cpu = cpunum();
+	struct Env *e, *cur;
+	bool resched = true;
+
+	spin_lock(&sched_lock);
+	runqs[cpu].rq_kicked = 0;
+	runqs[cpu].rq_nipirecv++;
+	if ((cur = cpu_curenv(cpu)))
+	{
+		runtime_charge(cpu, cur);
+		resched = (e = runq_first(cpu)) && runq_before(e, cur);
+	}
+	spin_unlock(&sched_lock);
+	return resched;
+}
+
+// Make e this CPU's environment and run it.  Called with sched_lock
+// held; picking e and marking it ENV_RUNNING happen under the same
+// hold, so no other CPU can pick it too.
+static void __attribute__((noreturn))
+sched_run(struct Env *e)
+{
+	int cpu = cpunum();
+	struct Env *cur = cpu_curenv(cpu);
+
+	if (e != cur)
+	{
+		if (cur)
+			__sched_set_status(cur, ENV_RUNNABLE);
+		curenv = e;
+		e->env_cpunum = cpu;
+		__sched_set_status(e, ENV_RUNNING);
+		e->env_runs++;
+		runqs[cpu].rq_nrun++;
+	}
+	spin_unlock(&sched_lock);
+	env_run(e);
+}
+
+// If another CPU killed curenv while it was in the kernel on this
+// one, it left freeing it to us: free it before giving up the CPU.
+static void
+free_dying_curenv(int cpu)
+{
+	if (curenv && curenv->env_status == ENV_DYING &&
+	    curenv->env_cpunum == cpu)
+	{
+		spin_lock(&env_lock);
+		env_free(curenv);
+		spin_unlock(&env_lock);
+		curenv = NULL;
+	}
+}
+
+// Choose a user environment to run and run it.
+void sched_yield(void)
+{
+	int cpu = cpunum();
+	struct Env *e, *cur;
+
+	// Run the environment this CPU's run queue says should go next.
+	// With the MLFQ, that is the head of the highest non-empty level;
+	// environments go back on the tail of their level when they are
+	// preempted, so this is round-robin among the runnable
+	// environments of the same priority.  With SCHED_CFS, it is the
+	// one that has had the least weighted CPU time.
+	//
+	// If the environment previously running on this CPU is still
+	// ENV_RUNNING, keep running it if it should go before that one.
+	// If its affinity mask no longer includes this CPU, hand it to one
+	// that is allowed instead.
+	//
+	// Before picking, even out the load with the busiest CPU so that
+	// an idle or lightly loaded CPU picks up work queued elsewhere.
+	//
+	// If another CPU killed curenv while it was in the kernel here,
+	// it left freeing it to us.
+	free_dying_curenv(cpu);
+	spin_lock(&sched_lock);
+	if ((cur = cpu_curenv(cpu)))
+	{
+		runtime_charge(cpu, cur);
+		if (!cpu_allowed(cur, cpu))
 		{
-			env_run(curenv);
+			__sched_set_status(cur, ENV_RUNNABLE);
+			cur = NULL;
 		}
 	}
+	runq_balance(cpu);
+	e = runq_first(cpu);
+	if (e && !(cur && runq_before(cur, e)))
+		sched_run(e);
+
+	if (cur)
+		sched_run(cur);
+
 	// sched_halt never returns
 	sched_halt();
 }
 
+// Hand this CPU, and what is left of curenv's time slice, to e, and
+// put curenv (if it is still ENV_RUNNING) back on this CPU's run
+// queue.  Used when curenv is waiting for e to do something, like the
+// other end of a pipe or an IPC exchange.  If e is not waiting for a
+// CPU, or may not run on this one, this is just sched_yield().
+void sched_yield_to(struct Env *e)
+{
+	int cpu = cpunum();
+	int32_t left = 0;
+
+	free_dying_curenv(cpu);
+	spin_lock(&sched_lock);
+	if (e->env_status == ENV_RUNNABLE && cpu_allowed(e, cpu))
+	{
+		// curenv's slice, even if it just blocked
+		if (curenv)
+			left = runqs[cpu].rq_slice_end - time_msec();
+		if (e->env_rq_cpu != cpu)
+			runq_move(e, cpu);
+		runqs[cpu].rq_donated = left > 0 ? left : 0;
+		runqs[cpu].rq_nhandoff++;
+		sched_run(e);
+	}
+	spin_unlock(&sched_lock);
+	sched_yield();
+}
+
 // Halt this CPU when there is nothing to do. Wait until the
-// timer interrupt wakes it up. This function never returns.
+// timer interrupt or a reschedule IPI wakes it up. This function
+// never returns.  Called with sched_lock held.
 //
 void sched_halt(void)
 {
-	int i;
+	int cpu = cpunum();
+	struct Env *e;
 
 	// For debugging and testing purposes, if there are no runnable
 	// environments in the system, then drop into the kernel monitor.
-	for (i = 0; i < NENV; i++)
-	{
-		if ((envs[i].env_status == ENV_RUNNABLE ||
-				 envs[i].env_status == ENV_RUNNING ||
-				 envs[i].env_status == ENV_DYING))
-			break;
-	}
-
-	if (i == NENV)
+	// Only the boot CPU does, so CPUs don't fight over the console.
+	if (sched_nactive == 0 && thiscpu == bootcpu)
 	{
+		spin_unlock(&sched_lock);
 		cprintf("No runnable environments in the system!\n");
 		while (1)
 			monitor(NULL);
@@ -88,13 +974,26 @@ void sched_halt(void)
 	curenv = NULL;
 	lcr3(PADDR(kern_pgdir));
 
-	// Mark that this CPU is in the HALT state, so that when
-	// timer interupts come in, we know we should re-acquire the
-	// big kernel lock
+	// Spend idle time zeroing free pages for page_alloc(ALLOC_ZERO), a
+	// batch at a time.  Nobody sends this CPU a reschedule IPI while
+	// it isn't CPU_HALTED, so look for work after each batch.
+	while (page_zero_wanted())
+	{
+		spin_unlock(&sched_lock);
+		page_zero_idle();
+		spin_lock(&sched_lock);
+		runq_balance(cpu);
+		if ((e = runq_first(cpu)))
+			sched_run(e);
+	}
+
+	timer_arm(time_msec());
+
+	// Mark that this CPU is in the HALT state, so that other CPUs
+	// send it a reschedule IPI when they queue work for it.
 	xchg(&thiscpu->cpu_status, CPU_HALTED);
 
-	// Release the big kernel lock as if we were "leaving" the kernel
-	unlock_kernel();
+	spin_unlock(&sched_lock);
 
 	// Reset stack pointer, enable interrupts and then halt.
 	asm volatile(
@@ -108,6 +1007,50 @@ void sched_halt(void)
 			"hlt\n"
 			"jmp 1b\n"
 			:
-			: "a"(thiscpu->cpu_ts.ts_esp0));
+			: "a"(KSTACKTOP - cpunum() * (KSTKSIZE + KSTKGAP)));
+	panic("sched_halt: hlt loop returned"); /* mostly to placate the compiler */
 }
 
+// Print per-CPU run queue statistics.
+void sched_print_stats(void)
+{
+	int i;
+#ifndef SCHED_CFS
+	int prio;
+	uint32_t n;
+	struct Env *e;
+#endif
+
+	spin_lock(&sched_lock);
+#ifndef SCHED_CFS
+	cprintf("cpu  status  queued  running   ticks     switches  pulled  pushed  handoff  ipi-tx  ipi-rx  per-level\n");
+#else
+	cprintf("cpu  status  queued  running   ticks     switches  pulled  pushed  handoff  ipi-tx  ipi-rx  vruntime\n");
+#endif
+	for (i = 0; i < ncpu; i++)
+	{
+		struct Env *cur = cpu_curenv(i);
+
+		cprintf("%3d  %-6s  %6u  %08x  %8u  %8u  %6u  %6u  %7u  %6u  %6u ", i,
+						cpus[i].cpu_status == CPU_HALTED ? "halted" : "busy",
+						runqs[i].rq_len, cur ? cur->env_id : 0,
+						runqs[i].rq_nticks, runqs[i].rq_nrun, runqs[i].rq_npulled,
+						runqs[i].rq_npushed, runqs[i].rq_nhandoff,
+						runqs[i].rq_nipisent, runqs[i].rq_nipirecv);
+#ifndef SCHED_CFS
+		for (prio = 0; prio < NPRIO; prio++)
+		{
+			n = 0;
+			for (e = runqs[i].rq_head[prio]; e; e = e->env_rq_next)
+				n++;
+			cprintf(" %u", n);
+		}
+		cprintf("\n");
+#else
+		cprintf(" %lld\n", runqs[i].rq_min_vruntime);
+#endif
+	}
+	cprintf("active environments: %u, sleeping: %u\n", sched_nactive,
+					sched_nsleeping);
+	spin_unlock(&sched_lock);
+}
@@ -6,7 +6,24 @@
 # error "This is a JOS kernel header; user programs should not #include it"
 #endif
 
+#include <inc/types.h>
+
+// Schedule by weighted virtual runtime, like Linux's CFS, instead of
+// with the multi-level feedback queue.
+// #define SCHED_CFS
+
+struct Env;
+
 // This function does not return.
 void sched_yield(void) __attribute__((noreturn));
+void sched_yield_to(struct Env *e) __attribute__((noreturn));
+void sched_set_status(struct Env *e, unsigned status);
+bool sched_set_dying(struct Env *e);
+void sched_set_priority(struct Env *e, int prio);
+void sched_set_affinity(struct Env *e, uint32_t mask);
+void sched_sleep(struct Env *e, unsigned int wakeup);
+bool sched_tick(void);
+bool sched_ipi(void);
+void sched_print_stats(void);
 
 #endif	// !JOS_KERN_SCHED_H
@@ -9,12 +9,54 @@
 #include <kern/spinlock.h>
 #include <kern/kdebug.h>
 
-// The big kernel lock
-struct spinlock kernel_lock __user_mapped_data = {
-#ifdef DEBUG_SPINLOCK
-		.name = "kernel_lock"
+#ifdef SPINLOCK_MCS
+// A CPU's place in the queue of an MCS lock.  Each CPU spins on the
+// 'waiting' flag of its own node until the CPU ahead of it clears it.
+struct mcs_node {
+	struct mcs_node *volatile next;	// CPU queued behind us
+	volatile unsigned waiting;
+	bool used;
+} __attribute__((aligned(64)));
+
+// A CPU needs a node for every lock it holds or waits for.  Locks
+// aren't always released in the reverse order they were taken, so
+// these are a pool rather than a stack.
+#define MCS_NNODE	8
+static struct mcs_node mcs_nodes[NCPU][MCS_NNODE];
+
+static struct mcs_node *
+mcs_node_alloc(void)
+{
+	struct mcs_node *node = mcs_nodes[cpunum()];
+	int i;
+
+	for (i = 0; i < MCS_NNODE; i++, node++)
+		if (!node->used)
+		{
+			node->used = 1;
+			node->next = NULL;
+			node->waiting = 1;
+			return node;
+		}
+	panic("CPU %d holds too many locks", cpunum());
+}
 #endif
-};
+
+// All locks that have been acquired, for spin_print_stats()
+static struct spinlock *volatile spin_list;
+
+// Is anyone holding the lock?
+static bool
+spin_held(struct spinlock *lk)
+{
+#if defined(SPINLOCK_TICKET)
+	return lk->next != lk->owner;
+#elif defined(SPINLOCK_MCS)
+	return lk->tail != NULL;
+#else
+	return lk->locked;
+#endif
+}
 
 #ifdef DEBUG_SPINLOCK
 // Record the current call stack in pcs[] by following the %ebp chain.
@@ -38,19 +80,134 @@ get_caller_pcs(uint32_t pcs[])
 
 // Check whether this CPU is holding the lock.
 static int
-holding(struct spinlock *lock)
+holding(struct spinlock *lk)
+{
+	return spin_held(lk) && lk->cpu == thiscpu;
+}
+
+// Lock profile.  Wait and hold times are kept per lock name, so the
+// NENV per-env page table locks add up to one entry, in histograms
+// whose bucket i counts times in [4^i, 4^(i+1)) TSC cycles.  Each CPU
+// keeps its own profile, so recording needs no locking and doesn't
+// bounce cache lines; spin_print_profile() adds them up.
+#define NLOCKCLASS	32
+#define NPROFBUCKET	12
+#define NPROFSITE	4
+
+struct lock_site {
+	uintptr_t pc[2];	// See spinlock.site
+	uint64_t max_hold;	// Longest hold from here
+};
+
+struct lock_prof {
+	uint32_t nacquire;
+	uint32_t ncontended;
+	uint64_t wait_cycles;
+	uint64_t hold_cycles;
+	uint32_t wait_hist[NPROFBUCKET];
+	uint32_t hold_hist[NPROFBUCKET];
+	struct lock_site sites[NPROFSITE];	// Held the longest
+};
+
+static const char *lock_classes[NLOCKCLASS];
+static int nlock_classes;
+static volatile uint32_t lock_classes_locked;
+static struct lock_prof lock_profs[NCPU][NLOCKCLASS];
+
+// Find the profile entry for lk's name, adding one if it is new.
+static int
+prof_class(struct spinlock *lk)
+{
+	int i;
+
+	// Can't use a spinlock to protect the table of spinlocks
+	while (xchg(&lock_classes_locked, 1) != 0)
+		asm volatile("pause");
+	for (i = 0; i < nlock_classes; i++)
+		if (strcmp(lock_classes[i], lk->name) == 0)
+			break;
+	if (i == nlock_classes && i < NLOCKCLASS)
+		lock_classes[nlock_classes++] = lk->name;
+	xchg(&lock_classes_locked, 0);
+	// Not profiled if the table is full
+	return i < NLOCKCLASS ? i + 1 : -1;
+}
+
+static int
+prof_bucket(uint64_t cycles)
+{
+	int b;
+
+	if (cycles >> 32)
+		return NPROFBUCKET - 1;
+	if ((uint32_t) cycles < 4)
+		return 0;
+	b = (31 - __builtin_clz((uint32_t) cycles)) / 2;
+	return b < NPROFBUCKET ? b : NPROFBUCKET - 1;
+}
+
+static struct lock_prof *
+prof_get(struct spinlock *lk)
+{
+	if (lk->prof_class == 0)
+		lk->prof_class = prof_class(lk);
+	if (lk->prof_class < 0)
+		return NULL;
+	return &lock_profs[cpunum()][lk->prof_class - 1];
+}
+
+static void
+prof_acquired(struct spinlock *lk, uint64_t wait)
+{
+	struct lock_prof *p = prof_get(lk);
+
+	if (!p)
+		return;
+	p->nacquire++;
+	if (wait)
+		p->ncontended++;
+	p->wait_cycles += wait;
+	p->wait_hist[prof_bucket(wait)]++;
+}
+
+static void
+prof_released(struct spinlock *lk, uint64_t hold)
 {
-	return lock->locked && lock->cpu == thiscpu;
+	struct lock_prof *p = prof_get(lk);
+	struct lock_site *s, *min;
+
+	if (!p)
+		return;
+	p->hold_cycles += hold;
+	p->hold_hist[prof_bucket(hold)]++;
+
+	// Keep the call sites that held it the longest
+	min = NULL;
+	for (s = p->sites; s < p->sites + NPROFSITE; s++)
+	{
+		if (s->pc[0] == lk->site[0] && s->pc[1] == lk->site[1])
+			break;
+		if (!min || s->max_hold < min->max_hold)
+			min = s;
+	}
+	if (s == p->sites + NPROFSITE)
+	{
+		if (hold <= min->max_hold)
+			return;
+		s = min;
+		s->pc[0] = lk->site[0];
+		s->pc[1] = lk->site[1];
+		s->max_hold = 0;
+	}
+	if (hold > s->max_hold)
+		s->max_hold = hold;
 }
 #endif
 
 void __spin_initlock(struct spinlock *lk, char *name)
 {
-	lk->locked = 0;
-#ifdef DEBUG_SPINLOCK
+	memset(lk, 0, sizeof(*lk));
 	lk->name = name;
-	lk->cpu = 0;
-#endif
 }
 
 // Acquire the lock.
@@ -59,21 +216,83 @@ void __spin_initlock(struct spinlock *lk, char *name)
 // other CPUs to waste time spinning to acquire it.
 void spin_lock(struct spinlock *lk)
 {
+	uint64_t start;
+	struct spinlock *head;
+
 #ifdef DEBUG_SPINLOCK
 	if (holding(lk))
 		panic("CPU %d cannot acquire %s: already holding", cpunum(), lk->name);
 #endif
 
+	// Only read the TSC if we have to wait.
+	start = 0;
+#if defined(SPINLOCK_TICKET)
+	// Take a ticket and wait for it to be called.
+	unsigned ticket = xadd(&lk->next, 1);
+
+	if (lk->owner != ticket)
+	{
+		start = read_tsc();
+		while (lk->owner != ticket)
+			asm volatile("pause");
+	}
+#elif defined(SPINLOCK_MCS)
+	// Join the tail of the queue.  If there was a CPU ahead of us,
+	// wait for it to pass us the lock.
+	struct mcs_node *node = mcs_node_alloc();
+	struct mcs_node *prev;
+
+	prev = (struct mcs_node *)xchg((volatile uint32_t *)&lk->tail,
+																 (uint32_t)node);
+	if (prev)
+	{
+		start = read_tsc();
+		prev->next = node;
+		while (node->waiting)
+			asm volatile("pause");
+	}
+	lk->holder = node;
+#else
 	// The xchg is atomic.
 	// It also serializes, so that reads after acquire are not
 	// reordered before it.
-	while (xchg(&lk->locked, 1) != 0)
-		asm volatile("pause");
+	if (xchg(&lk->locked, 1) != 0)
+	{
+		start = read_tsc();
+		while (xchg(&lk->locked, 1) != 0)
+			asm volatile("pause");
+	}
+#endif
+
+	if (start)
+	{
+		lk->ncontended++;
+		lk->spin_cycles += read_tsc() - start;
+	}
+	lk->nacquire++;
+	if (!lk->listed)
+	{
+		// Other CPUs may be adding different locks
+		lk->listed = 1;
+		do
+		{
+			head = spin_list;
+			lk->list_next = head;
+		} while (cmpxchg((volatile uint32_t *)&spin_list, (uint32_t)head,
+										 (uint32_t)lk) != (uint32_t)head);
+	}
 
 		// Record info about lock acquisition for debugging.
 #ifdef DEBUG_SPINLOCK
+	uint32_t *ebp = (uint32_t *)read_ebp();
+
 	lk->cpu = thiscpu;
 	get_caller_pcs(lk->pcs);
+	lk->site[0] = ebp[1];
+	ebp = (uint32_t *)ebp[0];
+	lk->site[1] = ebp >= (uint32_t *)ULIM ? ebp[1] : 0;
+	lk->acquired = read_tsc();
+	prof_acquired(lk, start ? lk->acquired - start : 0);
 #endif
 }
 
@@ -89,7 +308,7 @@ void spin_unlock(struct spinlock *lk)
 		// Nab the acquiring EIP chain before it gets released
 		memmove(pcs, lk->pcs, sizeof pcs);
 		cprintf("CPU %d cannot release %s: held by CPU %d\nAcquired at:",
-						cpunum(), lk->name, lk->cpu->cpu_id);
+						cpunum(), lk->name, lk->cpu ? lk->cpu->cpu_id : -1);
 		for (i = 0; i < 10 && pcs[i]; i++)
 		{
 			struct Eipdebuginfo info;
@@ -104,14 +323,209 @@ void spin_unlock(struct spinlock *lk)
 		panic("spin_unlock");
 	}
 
+	prof_released(lk, read_tsc() - lk->acquired);
 	lk->pcs[0] = 0;
 	lk->cpu = 0;
 #endif
 
+#if defined(SPINLOCK_TICKET)
+	// Only the holder writes owner, so this needs no locked
+	// instruction.  The barrier keeps the compiler from moving
+	// accesses to the data the lock protects past it.
+	asm volatile("" : : : "memory");
+	lk->owner++;
+#elif defined(SPINLOCK_MCS)
+	struct mcs_node *node = lk->holder;
+
+	if (!node->next)
+	{
+		// Nobody is queued behind us, unless one is just joining.
+		if (cmpxchg((volatile uint32_t *)&lk->tail, (uint32_t)node, 0) ==
+				(uint32_t)node)
+		{
+			node->used = 0;
+			return;
+		}
+		while (!node->next)
+			asm volatile("pause");
+	}
+	node->next->waiting = 0;
+	node->used = 0;
+#else
 	// The xchg instruction is atomic (i.e. uses the "lock" prefix) with
 	// respect to any other instruction which references the same memory.
 	// x86 CPUs will not reorder loads/stores across locked instructions
 	// (vol 3, 8.2.2). Because xchg() is implemented using asm volatile,
 	// gcc will not reorder C statements across the xchg.
 	xchg(&lk->locked, 0);
+#endif
+}
+
+// Print how often each kind of lock was contended and how long CPUs
+// spun waiting for it.  Locks with the same name, like the per-env
+// locks, are added together.
+void spin_print_stats(void)
+{
+	struct spinlock *lk, *other;
+	uint64_t ncontended, nacquire, cycles;
+	int nlocks;
+
+#if defined(SPINLOCK_TICKET)
+	cprintf("ticket locks\n");
+#elif defined(SPINLOCK_MCS)
+	cprintf("MCS locks\n");
+#else
+	cprintf("test-and-set locks\n");
+#endif
+	cprintf("lock              count  acquired   contended  spin cycles   cycles/wait\n");
+	for (lk = spin_list; lk; lk = lk->list_next)
+	{
+		// Skip it if we printed its name already
+		for (other = spin_list; other != lk; other = other->list_next)
+			if (strcmp(other->name, lk->name) == 0)
+				break;
+		if (other != lk)
+			continue;
+
+		nlocks = 0;
+		nacquire = ncontended = cycles = 0;
+		for (other = lk; other; other = other->list_next)
+			if (strcmp(other->name, lk->name) == 0)
+			{
+				nlocks++;
+				nacquire += other->nacquire;
+				ncontended += other->ncontended;
+				cycles += other->spin_cycles;
+			}
+		cprintf("%-16s  %5d  %8llu  %8llu  %12llu  %12llu\n", lk->name,
+						nlocks, nacquire, ncontended, cycles,
+						ncontended ? cycles / ncontended : 0);
+	}
+}
+
+#ifdef DEBUG_SPINLOCK
+static void
+print_hist(const char *what, uint32_t *hist)
+{
+	int i;
+
+	cprintf("  %-10s", what);
+	for (i = 0; i < NPROFBUCKET; i++)
+		cprintf(" %6u", hist[i]);
+	cprintf("\n");
+}
+
+static void
+print_site(uintptr_t pc)
+{
+	struct Eipdebuginfo info;
+
+	if (pc && debuginfo_eip(pc, &info) >= 0)
+		cprintf("%s:%d: %.*s+%x", info.eip_file, info.eip_line,
+						info.eip_fn_namelen, info.eip_fn_name,
+						pc - info.eip_fn_addr);
+	else
+		cprintf("%08x", pc);
+}
+#endif
+
+// Print the profile of the n locks CPUs spent the most time waiting
+// for: wait and hold time histograms, and the call sites that held
+// each lock the longest.
+void spin_print_profile(int n)
+{
+#ifdef DEBUG_SPINLOCK
+	static struct lock_prof sum[NLOCKCLASS];
+	bool shown[NLOCKCLASS];
+	struct lock_prof *p, *q;
+	struct lock_site *s, *t;
+	int cpu, i, j, k, best, nclass = nlock_classes;
+
+	// Add up the per-CPU profiles, merging call sites
+	memset(sum, 0, sizeof(sum));
+	for (i = 0; i < nclass; i++)
+	{
+		p = &sum[i];
+		shown[i] = 0;
+		for (cpu = 0; cpu < ncpu; cpu++)
+		{
+			q = &lock_profs[cpu][i];
+			p->nacquire += q->nacquire;
+			p->ncontended += q->ncontended;
+			p->wait_cycles += q->wait_cycles;
+			p->hold_cycles += q->hold_cycles;
+			for (j = 0; j < NPROFBUCKET; j++)
+			{
+				p->wait_hist[j] += q->wait_hist[j];
+				p->hold_hist[j] += q->hold_hist[j];
+			}
+			for (t = q->sites; t < q->sites + NPROFSITE && t->max_hold; t++)
+			{
+				struct lock_site *min = NULL;
+
+				for (s = p->sites; s < p->sites + NPROFSITE; s++)
+				{
+					if (s->pc[0] == t->pc[0] && s->pc[1] == t->pc[1])
+						break;
+					if (!min || s->max_hold < min->max_hold)
+						min = s;
+				}
+				if (s == p->sites + NPROFSITE)
+				{
+					if (t->max_hold <= min->max_hold)
+						continue;
+					*min = *t;
+				}
+				else if (t->max_hold > s->max_hold)
+					s->max_hold = t->max_hold;
+			}
+		}
+	}
+
+	cprintf("cycles      ");
+	for (j = 0; j < NPROFBUCKET; j++)
+		if (j < 5)
+			cprintf(" %6u", 1 << (2 * j));
+		else if (j < 10)
+			cprintf(" %5uK", 1 << (2 * j - 10));
+		else
+			cprintf(" %5uM", 1 << (2 * j - 20));
+	cprintf("\n");
+	for (k = 0; k < n && k < nclass; k++)
+	{
+		// Next most waited-for lock
+		best = -1;
+		for (i = 0; i < nclass; i++)
+			if (!shown[i] && (best < 0 ||
+												sum[i].wait_cycles > sum[best].wait_cycles))
+				best = i;
+		shown[best] = 1;
+		p = &sum[best];
+
+		cprintf("%s: %u acquired, %u contended, %llu cycles waiting, "
+						"%llu held\n", lock_classes[best], p->nacquire,
+						p->ncontended, p->wait_cycles, p->hold_cycles);
+		print_hist("wait", p->wait_hist);
+		print_hist("hold", p->hold_hist);
+
+		// Call sites, longest hold first
+		for (j = 0; j < NPROFSITE; j++)
+		{
+			t = NULL;
+			for (s = p->sites; s < p->sites + NPROFSITE; s++)
+				if (s->max_hold && (!t || s->max_hold > t->max_hold))
+					t = s;
+			if (!t)
+				break;
+			cprintf("  %10llu  ", t->max_hold);
+			print_site(t->pc[0]);
+			cprintf(" <- ");
+			print_site(t->pc[1]);
+			cprintf("\n");
+			t->max_hold = 0;
+		}
+	}
+#else
+	cprintf("Lock profiling needs DEBUG_SPINLOCK\n");
+#endif
 }
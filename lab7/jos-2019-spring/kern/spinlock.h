@@ -4,47 +4,79 @@
 #include <inc/types.h>
 #include <kern/kpti.h>
 
-// Comment this to disable spinlock debugging
+// Comment this to disable spinlock debugging and profiling
 #define DEBUG_SPINLOCK
 
+// How spin_lock() waits.  By default it spins on an xchg of the lock
+// word itself, which is unfair and bounces the lock's cache line
+// between all the waiting CPUs.  Uncomment one of these for a lock
+// that is handed to waiters in the order they arrived:
+// ticket locks still spin on the shared lock, while MCS locks queue
+// the waiters and each spins on its own cache line.
+// #define SPINLOCK_TICKET
+// #define SPINLOCK_MCS
+
+struct mcs_node;
+
 // Mutual exclusion lock.
 struct spinlock {
+#if defined(SPINLOCK_TICKET)
+	volatile unsigned next;		// Next ticket to hand out
+	volatile unsigned owner;	// Ticket holding the lock
+#elif defined(SPINLOCK_MCS)
+	struct mcs_node *volatile tail;	// Last CPU in the queue
+	struct mcs_node *holder;	// Queue node of the holder
+#else
 	unsigned locked;       // Is the lock held?
+#endif
+	char *name;            // Name of lock.
+
+	// Statistics, updated by the holder
+	uint32_t nacquire;	// Times acquired
+	uint32_t ncontended;	// Times we had to wait for another CPU
+	uint64_t spin_cycles;	// TSC cycles spent waiting
+	bool listed;		// On the list spin_print_stats() walks
+	struct spinlock *list_next;
 
 #ifdef DEBUG_SPINLOCK
 	// For debugging:
-	char *name;            // Name of lock.
 	struct CpuInfo *cpu;   // The CPU holding the lock.
 	uintptr_t pcs[10];     // The call stack (an array of program counters)
 	                       // that locked the lock.
+
+	// For profiling:
+	int prof_class;		// Index in the profile by name, plus 1
+	uint64_t acquired;	// TSC when acquired
+	uintptr_t site[2];	// Caller of spin_lock() and its caller
 #endif
 };
 
 void __spin_initlock(struct spinlock *lk, char *name);
 void spin_lock(struct spinlock *lk);
 __user_mapped_text void spin_unlock(struct spinlock *lk);
+void spin_print_stats(void);
+void spin_print_profile(int n);
 
 #define spin_initlock(lock)   __spin_initlock(lock, #lock)
 
-extern struct spinlock kernel_lock;
-
-static inline void
-lock_kernel(void)
-{
-	spin_lock(&kernel_lock);
-}
-
-__user_mapped_text
-static inline void
-unlock_kernel(void)
-{
-	spin_unlock(&kernel_lock);
-
-	// Normally we wouldn't need to do this, but QEMU only runs
-	// one CPU at a time and has a long time-slice.  Without the
-	// pause, this CPU is likely to reacquire the lock before
-	// another CPU has even been given a chance to acquire it.
-	asm volatile("pause");
-}
+// Static initializer, for locks defined at file scope:
+//	struct spinlock foo_lock = SPINLOCK_INIT(foo_lock);
+#define SPINLOCK_INIT(lock)   { .name = #lock }
+
+// There is no big kernel lock.  Each subsystem protects its own state;
+// when more than one lock is needed, they are taken in this order:
+//
+//	env_lock		kern/env.c: the env table, IPC state, and
+//				any env other than curenv while in use
+//	env_vm_lock(e)		kern/env.c: e's page tables; two at once
+//				in envs[] order, see env_vm_lock2()
+//	pc_lock			kern/pmap.c: a CPU's page cache
+//	page_lock		kern/pmap.c: the free list and pp_ref
+//	sched_lock		kern/sched.c: run queues, sleep queue and
+//				env_status
+//	e1000_lock, console	kern/e1000.c, kern/console.c: leaves
+//
+// Kernel code runs with interrupts off, so an interrupt handler never
+// spins on a lock its own CPU holds.
 
 #endif
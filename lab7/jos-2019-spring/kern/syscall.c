@@ -15,6 +15,80 @@
 #include <kern/e1000.h>
 #include <kern/spinlock.h>
 
+static int32_t syscall_dispatch(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5);
+
+// Look up envid like envid2env, and keep the environment from being
+// freed until the matching env_put.  Only curenv is safe to use without
+// env_lock, so for any other environment env_lock stays held in between.
+static int
+env_get(envid_t envid, struct Env **env_store, bool checkperm)
+{
+	int r;
+
+	if (envid == 0 || envid == curenv->env_id)
+	{
+		*env_store = curenv;
+		return 0;
+	}
+	spin_lock(&env_lock);
+	if ((r = envid2env(envid, env_store, checkperm)) < 0 ||
+	    *env_store == curenv)
+		spin_unlock(&env_lock);
+	return r;
+}
+
+static void
+env_put(struct Env *e)
+{
+	if (e != curenv)
+		spin_unlock(&env_lock);
+}
+
+// Like env_get, for two environments at once.
+static int
+env_get2(envid_t envid1, struct Env **env_store1,
+	 envid_t envid2, struct Env **env_store2, bool checkperm)
+{
+	int r;
+
+	if ((envid1 == 0 || envid1 == curenv->env_id) &&
+	    (envid2 == 0 || envid2 == curenv->env_id))
+	{
+		*env_store1 = *env_store2 = curenv;
+		return 0;
+	}
+	spin_lock(&env_lock);
+	if ((r = envid2env(envid1, env_store1, checkperm)) < 0 ||
+	    (r = envid2env(envid2, env_store2, checkperm)) < 0 ||
+	    (*env_store1 == curenv && *env_store2 == curenv))
+		spin_unlock(&env_lock);
+	return r;
+}
+
+static void
+env_put2(struct Env *e1, struct Env *e2)
+{
+	if (e1 != curenv || e2 != curenv)
+		spin_unlock(&env_lock);
+}
+
+// Check that curenv may access [va, va+len) like user_mem_assert, and
+// return with curenv's page tables locked so that no other CPU can
+// unmap the memory while we use it.  Release with env_vm_unlock(curenv).
+static void
+user_mem_hold(const void *va, size_t len, int perm)
+{
+	env_vm_lock(curenv);
+	while (user_mem_check(curenv, va, len, perm | PTE_U) < 0)
+	{
+		// user_mem_assert may destroy curenv, which must not be
+		// done holding the lock
+		env_vm_unlock(curenv);
+		user_mem_assert(curenv, va, len, perm);
+		env_vm_lock(curenv);
+	}
+}
+
 // Print a string to the system console.
 // The string is exactly 'len' characters long.
 // Destroys the environment on memory errors.
@@ -25,9 +99,10 @@ sys_cputs(const char *s, size_t len)
 	// Destroy the environment if not.
 
 	// LAB 3: Your code here.
-	user_mem_assert(curenv, (const void *)s, len, PTE_U);
+	user_mem_hold((const void *)s, len, PTE_U);
 	// Print the string supplied by the user.
 	cprintf("%.*s", len, s);
+	env_vm_unlock(curenv);
 }
 
 // Read a character from the system console without blocking.
@@ -56,9 +131,12 @@ sys_env_destroy(envid_t envid)
 	int r;
 	struct Env *e;
 
-	if ((r = envid2env(envid, &e, 1)) < 0)
+	if ((r = env_get(envid, &e, 1)) < 0)
 		return r;
-	env_destroy(e);
+	if (e == curenv)
+		env_destroy(curenv);
+	env_kill(e);
+	env_put(e);
 	return 0;
 }
 
@@ -69,6 +147,27 @@ sys_yield(void)
 	sched_yield();
 }
 
+// Give the rest of our time slice to environment 'envid' and let it
+// run on this CPU right away, if it is runnable; otherwise just yield.
+// For handing off to the other end of a producer/consumer pair
+// instead of waiting for the scheduler to get around to it.
+//
+// Returns 0 once we run again, or -E_BAD_ENV if environment envid
+// doesn't currently exist.
+static int
+sys_yield_to(envid_t envid)
+{
+	struct Env *e;
+
+	if (env_get(envid, &e, 0) < 0)
+		return -E_BAD_ENV;
+	env_put(e);
+	// e may be freed from here on, but its slot in envs stays, and
+	// sched_yield_to only runs it if it is runnable.
+	curenv->env_tf.tf_regs.reg_eax = 0;
+	sched_yield_to(e);
+}
+
 // Allocate a new environment.
 // Returns envid of new environment, or < 0 on error.  Errors are:
 //	-E_NO_FREE_ENV if no free environment is available.
@@ -92,7 +191,9 @@ sys_exofork(void)
 		return r;
 	}
 
-	e->env_status = ENV_NOT_RUNNABLE;
+	sched_set_status(e, ENV_NOT_RUNNABLE);
+	e->env_prio_base = curenv->env_prio_base;
+	e->env_affinity = curenv->env_affinity;
 	e->env_tf = curenv->env_tf;
 	e->env_tf.tf_regs.reg_eax = 0;
 
@@ -118,19 +219,77 @@ sys_env_set_status(envid_t envid, int status)
 	// LAB 4: Your code here.
 	int r;
 	struct Env *e;
-	r = envid2env(envid, &e, 1);
+	r = env_get(envid, &e, 1);
 	if (r < 0)
 	{
 		return -E_BAD_ENV;
 	}
 
 	assert(e);
+	r = -E_INVAL;
+	if (status != ENV_RUNNABLE && status != ENV_NOT_RUNNABLE)
+	{
+		goto out;
+	}
 	if (e->env_status == ENV_RUNNABLE || e->env_status == ENV_NOT_RUNNABLE)
 	{
-		e->env_status = status;
-		return 0;
+		sched_set_status(e, status);
+		r = 0;
+	}
+out:
+	env_put(e);
+	return r;
+}
+
+// Set envid's scheduling priority to 'prio', which must be between
+// ENV_PRIO_HIGH and ENV_PRIO_LOW.  Children created by sys_exofork
+// inherit the priority.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if prio is not a valid priority.
+static int
+sys_env_set_priority(envid_t envid, int prio)
+{
+	int r;
+	struct Env *e;
+
+	if (prio < ENV_PRIO_HIGH || prio > ENV_PRIO_LOW)
+		return -E_INVAL;
+	if ((r = env_get(envid, &e, 1)) < 0)
+		return r;
+	sched_set_priority(e, prio);
+	env_put(e);
+	return 0;
+}
+
+// Restrict envid to the CPUs whose bits are set in 'cpumask'.
+// Children created by sys_exofork inherit the mask.  If the caller
+// excludes the CPU it is running on, it moves before returning.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if cpumask contains none of the CPUs in the system.
+static int
+sys_env_set_affinity(envid_t envid, uint32_t cpumask)
+{
+	int r;
+	struct Env *e;
+
+	if (ncpu < 32 && !(cpumask & ((1 << ncpu) - 1)))
+		return -E_INVAL;
+	if ((r = env_get(envid, &e, 1)) < 0)
+		return r;
+	sched_set_affinity(e, cpumask);
+	env_put(e);
+	if (e == curenv && !(cpumask & (1 << cpunum())))
+	{
+		e->env_tf.tf_regs.reg_eax = 0;
+		sched_yield();
 	}
-	return -E_INVAL;
+	return 0;
 }
 
 // Set envid's trap frame to 'tf'.
@@ -148,17 +307,24 @@ sys_env_set_trapframe(envid_t envid, struct Trapframe *tf)
 	// address!
 	int r;
 	struct Env *e;
-	r = envid2env(envid, &e, 1);
+	struct Trapframe utf;
+
+	// Copy it in first: env_lock comes before our page table lock
+	user_mem_hold(tf, sizeof(struct Trapframe), 0);
+	utf = *tf;
+	env_vm_unlock(curenv);
+
+	r = env_get(envid, &e, 1);
 	if (r < 0)
 	{
 		return -E_BAD_ENV;
 	}
 
-	user_mem_assert(curenv, tf, sizeof(struct Trapframe), 0);
-	e->env_tf = *tf;
+	e->env_tf = utf;
 	e->env_tf.tf_cs |= 3;
 	e->env_tf.tf_eflags |= FL_IF;
 	e->env_tf.tf_eflags &= (~FL_IOPL_MASK);
+	env_put(e);
 
 	return 0;
 }
@@ -178,13 +344,14 @@ sys_env_set_pgfault_upcall(envid_t envid, void *func)
 	int r;
 	struct Env *e;
 
-	r = envid2env(envid, &e, 1);
+	r = env_get(envid, &e, 1);
 	if (r < 0)
 	{
 		return -E_BAD_ENV;
 	}
 
 	e->env_pgfault_upcall = func;
+	env_put(e);
 	return 0;
 }
 
@@ -218,42 +385,46 @@ sys_page_alloc(envid_t envid, void *va, int perm)
 	int r;
 	struct Env *e;
 
-	r = envid2env(envid, &e, 1);
+	r = env_get(envid, &e, 1);
 	if (r < 0)
 	{
 		return -E_BAD_ENV;
 	}
 
+	r = -E_INVAL;
 	if ((uintptr_t)va >= UTOP || ((uintptr_t)va % PGSIZE) != 0)
 	{
-		return -E_INVAL;
+		goto out;
 	}
 
 	if ((perm & (PTE_U | PTE_P)) == (PTE_U | PTE_P))
 	{
 		if ((perm & ~PTE_SYSCALL) > 0)
 		{
-			return -E_INVAL;
+			goto out;
 		}
 
 		struct PageInfo *p = page_alloc(ALLOC_ZERO);
 		if (p == NULL)
 		{
-			return -E_NO_MEM;
+			r = -E_NO_MEM;
+			goto out;
 		}
 
-		r = page_insert(e->env_pgdir, p, va, perm);
+		env_vm_lock(e);
+		r = env_page_insert(e, p, va, perm);
 		if (r < 0)
 		{
+			env_vm_unlock(e);
 			page_free(p);
-			return r;
+			goto out;
 		}
-		memmove(e->env_kern_pgdir + PDX(va), e->env_pgdir + PDX(va), sizeof(pde_t));
-
-		return 0;
+		env_vm_unlock(e);
 	}
 
-	return -E_INVAL;
+out:
+	env_put(e);
+	return r;
 }
 
 // Map the page of memory at 'srcva' in srcenvid's address space
@@ -288,43 +459,39 @@ sys_page_map(envid_t srcenvid, void *srcva,
 	struct Env *src_env;
 	struct Env *dst_env;
 
-	if ((r = envid2env(srcenvid, &src_env, 1)) < 0)
-	{
-		return r;
-	}
-	if ((r = envid2env(dstenvid, &dst_env, 1)) < 0)
+	if ((r = env_get2(srcenvid, &src_env, dstenvid, &dst_env, 1)) < 0)
 	{
 		return r;
 	}
 
+	r = -E_INVAL;
 	if ((uintptr_t)srcva >= UTOP || (uintptr_t)srcva % PGSIZE ||
 			(uintptr_t)dstva >= UTOP || (uintptr_t)dstva % PGSIZE)
 	{
-		return -E_INVAL;
+		goto out;
 	}
 
 	if ((perm & (PTE_U | PTE_P)) != (PTE_U | PTE_P) || perm & ~PTE_SYSCALL)
 	{
-		return -E_INVAL;
+		goto out;
 	}
 
+	env_vm_lock2(src_env, dst_env);
 	pte_t *pte;
 	struct PageInfo *p = page_lookup(src_env->env_pgdir, srcva, &pte);
-	if (p == NULL)
+	if (p == NULL || ((perm & PTE_W) && !(*pte & PTE_W)))
 	{
-		return -E_INVAL;
-	}
-
-	if ((perm & PTE_W) && !(*pte & PTE_W))
-	{
-		return -E_INVAL;
+		goto out_vm;
 	}
-	if ((r = page_insert(dst_env->env_pgdir, p, dstva, perm)) < 0)
+	if ((r = env_page_insert(dst_env, p, dstva, perm)) < 0)
 	{
-		return r;
+		goto out_vm;
 	}
-	memmove(dst_env->env_kern_pgdir + PDX(dstva), dst_env->env_pgdir + PDX(dstva), sizeof(pde_t));
 
+out_vm:
+	env_vm_unlock2(src_env, dst_env);
+out:
+	env_put2(src_env, dst_env);
 	return r;
 }
 
@@ -344,19 +511,21 @@ sys_page_unmap(envid_t envid, void *va)
 	int r;
 	struct Env *e;
 
-	r = envid2env(envid, &e, 1);
-	if (r < 0)
+	if ((uintptr_t)va >= UTOP || (uintptr_t)va % PGSIZE)
 	{
-		return r;
+		return -E_INVAL;
 	}
 
-	if ((uintptr_t)va >= UTOP || (uintptr_t)va % PGSIZE)
+	r = env_get(envid, &e, 1);
+	if (r < 0)
 	{
-		return -E_INVAL;
+		return r;
 	}
 
-	page_remove(e->env_pgdir, va);
-	memmove(e->env_kern_pgdir + PDX(va), e->env_pgdir + PDX(va), sizeof(pde_t));
+	env_vm_lock(e);
+	env_page_remove(e, va);
+	env_vm_unlock(e);
+	env_put(e);
 	return 0;
 }
 
@@ -398,17 +567,29 @@ sys_page_unmap(envid_t envid, void *va)
 //		current environment's address space.
 //	-E_NO_MEM if there's not enough memory to map srcva in envid's
 //		address space.
+//
+// If 'block' is false, a send to an environment that isn't receiving
+// fails with -E_IPC_NOT_RECV instead of waiting for it to receive.
 static int
-sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
+ipc_send(envid_t envid, uint32_t value, void *srcva, unsigned perm, bool block)
 {
 	// LAB 4: Your code here.
 	int r;
 	struct Env *e;
 
+	// The IPC fields of both ends are protected by env_lock, so hold
+	// it throughout, even if we're sending to ourselves.
+	spin_lock(&env_lock);
 	if ((r = envid2env(envid, &e, 0) < 0))
 	{
+		spin_unlock(&env_lock);
 		return -E_BAD_ENV;
 	}
+	if (!block && !e->env_ipc_recving)
+	{
+		r = -E_IPC_NOT_RECV;
+		goto out;
+	}
 	// if (!e->env_ipc_recving)
 	// {
 	// 	return -E_IPC_NOT_RECV;
@@ -416,38 +597,37 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 
 	if ((uintptr_t)srcva < UTOP && (((uintptr_t)e->env_ipc_dstva < UTOP && e->env_ipc_recving) || !e->env_ipc_recving))
 	{
+		r = -E_INVAL;
 		if ((uintptr_t)srcva % PGSIZE ||
 				(perm & (PTE_U | PTE_P)) != (PTE_U | PTE_P) ||
 				(perm & (~PTE_SYSCALL)))
 		{
-			return -E_INVAL;
+			goto out;
 		}
 
+		env_vm_lock2(curenv, e);
 		pte_t *pte;
 		struct PageInfo *p = page_lookup(curenv->env_pgdir, srcva, &pte);
-		if (p == NULL)
-		{
-			return -E_INVAL;
-		}
-
-		if ((perm & PTE_W) && ((*pte & PTE_W) == 0))
+		if (p == NULL || ((perm & PTE_W) && ((*pte & PTE_W) == 0)))
 		{
-			return -E_INVAL;
+			env_vm_unlock2(curenv, e);
+			goto out;
 		}
 
 		if (e->env_ipc_recving && (uintptr_t)e->env_ipc_dstva < UTOP)
 		{
-			if ((r = page_insert(e->env_pgdir, p, e->env_ipc_dstva, perm)) < 0)
+			if ((r = env_page_insert(e, p, e->env_ipc_dstva, perm)) < 0)
 			{
-				return r;
+				env_vm_unlock2(curenv, e);
+				goto out;
 			}
-			memmove(e->env_kern_pgdir + PDX(e->env_ipc_dstva), e->env_pgdir + PDX(e->env_ipc_dstva), sizeof(pde_t));
 		}
 		else
 		{
 			curenv->env_ipc_perm_pending = perm;
 			curenv->env_ipc_page_pending = p;
 		}
+		env_vm_unlock2(curenv, e);
 	}
 
 	if (e->env_ipc_recving)
@@ -456,18 +636,30 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 		e->env_ipc_from = curenv->env_id;
 		e->env_ipc_value = value;
 		e->env_ipc_perm = perm;
-		e->env_status = ENV_RUNNABLE;
+		// Once it's runnable, another CPU may run it right away
 		e->env_tf.tf_regs.reg_eax = 0;
+		sched_set_status(e, ENV_RUNNABLE);
 	}
 	else
 	{
 		curenv->env_ipc_to_pending = envid;
 		curenv->env_ipc_value_pending = value;
-		curenv->env_status = ENV_NOT_RUNNABLE;
-		sched_yield();
+		sched_set_status(curenv, ENV_NOT_RUNNABLE);
+		spin_unlock(&env_lock);
+		// The receiver has to run to get to sys_ipc_recv
+		sched_yield_to(e);
 	}
+	r = 0;
 
-	return 0;
+out:
+	spin_unlock(&env_lock);
+	return r;
+}
+
+static int
+sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
+{
+	return ipc_send(envid, value, srcva, perm, 1);
 }
 
 // Block until a value is ready.  Record that you want to receive
@@ -501,6 +693,7 @@ sys_ipc_recv(void *dstva)
 		return -E_INVAL;
 	}
 
+	spin_lock(&env_lock);
 	for (int i = 0; i < NENV; i++)
 	{
 		e = &envs[i];
@@ -508,27 +701,31 @@ sys_ipc_recv(void *dstva)
 		{
 			if (dstva < (void *)UTOP && e->env_ipc_page_pending != NULL)
 			{
-				if ((r = page_insert(curenv->env_pgdir, e->env_ipc_page_pending, dstva, e->env_ipc_perm_pending)) < 0)
+				env_vm_lock(curenv);
+				r = env_page_insert(curenv, e->env_ipc_page_pending, dstva, e->env_ipc_perm_pending);
+				env_vm_unlock(curenv);
+				if (r < 0)
 				{
+					spin_unlock(&env_lock);
 					return r;
 				}
-				memmove(curenv->env_kern_pgdir + PDX(dstva), curenv->env_pgdir + PDX(dstva), sizeof(pde_t));
 				curenv->env_ipc_perm = e->env_ipc_perm_pending;
 			}
 			curenv->env_ipc_from = e->env_id;
 			curenv->env_ipc_value = e->env_ipc_value_pending;
 			e->env_ipc_to_pending = 0;
-			e->env_status = ENV_RUNNABLE;
 			e->env_tf.tf_regs.reg_eax = 0;
+			sched_set_status(e, ENV_RUNNABLE);
+			spin_unlock(&env_lock);
 			return 0;
 		}
 	}
 
 	curenv->env_ipc_recving = 1;
 	curenv->env_ipc_dstva = dstva;
-	curenv->env_status = ENV_NOT_RUNNABLE;
+	sched_set_status(curenv, ENV_NOT_RUNNABLE);
+	spin_unlock(&env_lock);
 	sched_yield();
-	return 0;
 }
 
 static int
@@ -536,13 +733,12 @@ sys_map_kernel_page(void *kpage, void *va)
 {
 	int r;
 	struct PageInfo *p = pa2page(PADDR(kpage));
-	if (p == NULL)
+	if (p == NULL || (uintptr_t)va >= UTOP)
 		return -E_INVAL;
 
-	if ((r = page_insert(curenv->env_pgdir, p, va, PTE_U | PTE_W)) < 0)
-		return r;
-
-	memmove(curenv->env_kern_pgdir + PDX(va), curenv->env_pgdir + PDX(va), sizeof(pde_t));
+	env_vm_lock(curenv);
+	r = env_page_insert(curenv, p, va, PTE_U | PTE_W);
+	env_vm_unlock(curenv);
 
 	return r;
 }
@@ -563,7 +759,9 @@ sys_sbrk(uint32_t inc)
 	}
 
 	// Allocate more space, increase brk pointer.
+	env_vm_lock(curenv);
 	region_alloc(curenv, (void *)curenv->env_break, inc_size);
+	env_vm_unlock(curenv);
 	curenv->env_break += inc_size;
 	return curenv->env_break;
 }
@@ -576,14 +774,33 @@ sys_time_msec(void)
 	return time_msec();
 }
 
+// Block until sys_time_msec() reaches 'msec', without using any CPU.
+// Returns right away if that time has already passed.
+//
+// Returns 0.  Like sys_ipc_recv, this does not return to the caller
+// when it blocks; the system call returns 0 once the env is woken up.
+static int
+sys_sleep_until(unsigned int msec)
+{
+	if (msec <= time_msec())
+		return 0;
+	curenv->env_tf.tf_regs.reg_eax = 0;
+	sched_sleep(curenv, msec);
+	sched_yield();
+}
+
 int sys_net_send(const void *buf, uint32_t len)
 {
 	// LAB 6: Your code here.
 	// Check the user permission to [buf, buf + len]
 	// Call e1000_tx to send the packet
 	// Hint: e1000_tx only accept kernel virtual address
-	user_mem_assert(curenv, buf, len, 0);
-	return e1000_tx(buf, len);
+	int r;
+
+	user_mem_hold(buf, len, 0);
+	r = e1000_tx(buf, len);
+	env_vm_unlock(curenv);
+	return r;
 }
 
 int sys_net_recv(void *buf, uint32_t len)
@@ -592,8 +809,12 @@ int sys_net_recv(void *buf, uint32_t len)
 	// Check the user permission to [buf, buf + len]
 	// Call e1000_rx to fill the buffer
 	// Hint: e1000_rx only accept kernel virtual address
-	user_mem_assert(curenv, buf, len, 0);
-	return e1000_rx(buf, len);
+	int r;
+
+	user_mem_hold(buf, len, 0);
+	r = e1000_rx(buf, len);
+	env_vm_unlock(curenv);
+	return r;
 }
 
 static int
@@ -601,7 +822,7 @@ sys_exec(envid_t envid)
 {
 	int r;
 	struct Env *e;
-	if ((r = envid2env(envid, &e, 1)) < 0)
+	if ((r = env_get(envid, &e, 1)) < 0)
 	{
 		return r;
 	}
@@ -616,37 +837,388 @@ sys_exec(envid_t envid)
 
 	curenv->env_pgfault_upcall = e->env_pgfault_upcall;
 	curenv->env_break = e->env_break;
+	curenv->env_ring = e->env_ring;
 
-	env_destroy(e);
+	env_kill(e);
+	env_put(e);
 	lcr3(PADDR(curenv->env_pgdir));
 	env_run(curenv);
 
 	return 0;
 }
 
+// Make the 'n' system calls described by 'ops', in order, in one trip
+// into the kernel, storing what each one returned in its 'result'.
+// Only system calls that never block can be batched: SYS_page_alloc,
+// SYS_page_map, SYS_page_unmap and SYS_env_set_status.  Stops at the
+// first call that fails.  The results are written back to 'ops', so
+// the calls must not take away the caller's write access to it.
+//
+// Returns the number of calls that succeeded, n if all did, or
+// -E_INVAL if n is negative.
+static int
+sys_batch(struct SyscallOp *ops, int n)
+{
+	// Copied in and run a chunk at a time, since the calls take the
+	// page table lock we would need to hold to use 'ops' directly
+	struct SyscallOp chunk[16];
+	int i, m, done;
+
+	if (n < 0)
+		return -E_INVAL;
+	for (done = 0; done < n; done += m)
+	{
+		m = MIN(n - done, ARRAY_SIZE(chunk));
+		user_mem_hold(ops + done, m * sizeof(*ops), PTE_W);
+		memmove(chunk, ops + done, m * sizeof(*ops));
+		env_vm_unlock(curenv);
+
+		for (i = 0; i < m; i++)
+		{
+			switch (chunk[i].num)
+			{
+			case SYS_page_alloc:
+			case SYS_page_map:
+			case SYS_page_unmap:
+			case SYS_env_set_status:
+				chunk[i].result = syscall(chunk[i].num,
+																	chunk[i].args[0], chunk[i].args[1],
+																	chunk[i].args[2], chunk[i].args[3],
+																	chunk[i].args[4]);
+				break;
+			default:
+				chunk[i].result = -E_INVAL;
+			}
+			if (chunk[i].result < 0)
+			{
+				m = i + 1;
+				break;
+			}
+		}
+
+		user_mem_hold(ops + done, m * sizeof(*ops), PTE_W);
+		for (i = 0; i < m; i++)
+			ops[done + i].result = chunk[i].result;
+		env_vm_unlock(curenv);
+		if (chunk[m - 1].result < 0)
+			return done + m - 1;
+	}
+	return n;
+}
+
+// Syscall tracing.  While it is on, syscall() records each call made
+// by the tracer's descendants in a ring for the CPU making it, which
+// the tracer empties with sys_trace.  When a ring is full the oldest
+// record is lost.  There is one tracer at a time.
+#define NTRACE 256
+
+struct trace_ring
+{
+	struct spinlock lock;
+	uint32_t head; // Records ever written
+	uint32_t tail; // Records ever read or lost
+	struct SyscallTrace recs[NTRACE];
+};
+
+static struct trace_ring trace_rings[NCPU] = {
+		[0 ... NCPU - 1] = {.lock = SPINLOCK_INIT(trace_lock)}};
+static volatile bool trace_on;
+// The env that last called sys_trace.  It alone may read the rings
+// until it exits.  Protected by env_lock.
+static envid_t trace_owner;
+
+// Is e's system call to be traced?
+static bool
+traced(struct Env *e)
+{
+	return trace_on && e->env_tracer == trace_owner && e->env_id != trace_owner;
+}
+
+// Record the start of a call on this CPU.
+// Returns the record's number, for trace_exit.
+static uint32_t
+trace_enter(uint32_t num, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5)
+{
+	struct trace_ring *tr = &trace_rings[cpunum()];
+	struct SyscallTrace *t;
+	uint32_t seq;
+
+	spin_lock(&tr->lock);
+	if (tr->head - tr->tail == NTRACE)
+		tr->tail++;
+	seq = tr->head++;
+	t = &tr->recs[seq % NTRACE];
+	t->env = curenv->env_id;
+	t->num = num;
+	t->args[0] = a1;
+	t->args[1] = a2;
+	t->args[2] = a3;
+	t->args[3] = a4;
+	t->args[4] = a5;
+	t->result = 0;
+	t->tsc_exit = 0;
+	t->tsc_enter = read_tsc();
+	spin_unlock(&tr->lock);
+	return seq;
+}
+
+// Record the end of the call trace_enter numbered 'seq', unless its
+// record was read or lost in the meantime.
+static void
+trace_exit(int cpu, uint32_t seq, int32_t result)
+{
+	struct trace_ring *tr = &trace_rings[cpu];
+	uint64_t now = read_tsc();
+
+	spin_lock(&tr->lock);
+	if (seq - tr->tail < tr->head - tr->tail)
+	{
+		tr->recs[seq % NTRACE].result = result;
+		tr->recs[seq % NTRACE].tsc_exit = now;
+	}
+	spin_unlock(&tr->lock);
+}
+
+// Turn tracing of the system calls made by curenv's descendants on
+// or off, and move up to 'n' of the records collected so far into
+// 'buf', oldest first for each CPU.
+// Returns the number of records moved, -E_INVAL if n is negative, or
+// -E_AGAIN if another environment that still exists is tracing.
+static int
+sys_trace(int on, struct SyscallTrace *buf, int n)
+{
+	struct trace_ring *tr;
+	struct Env *e;
+	int i, m;
+
+	if (n < 0)
+		return -E_INVAL;
+	n = MIN(n, NCPU * NTRACE);
+
+	spin_lock(&env_lock);
+	if (trace_owner != curenv->env_id)
+	{
+		if (trace_owner && envid2env(trace_owner, &e, 0) == 0)
+		{
+			spin_unlock(&env_lock);
+			return -E_AGAIN;
+		}
+		// Take over from a tracer that is gone, without letting
+		// curenv see what it traced
+		trace_owner = curenv->env_id;
+		for (i = 0; i < ncpu; i++)
+		{
+			spin_lock(&trace_rings[i].lock);
+			trace_rings[i].tail = trace_rings[i].head;
+			spin_unlock(&trace_rings[i].lock);
+		}
+	}
+	curenv->env_tracer = on ? curenv->env_id : 0;
+	trace_on = on;
+	spin_unlock(&env_lock);
+
+	user_mem_hold(buf, n * sizeof(*buf), PTE_W);
+	for (i = 0, m = 0; i < ncpu && m < n; i++)
+	{
+		tr = &trace_rings[i];
+		spin_lock(&tr->lock);
+		while (tr->tail != tr->head && m < n)
+			buf[m++] = tr->recs[tr->tail++ % NTRACE];
+		spin_unlock(&tr->lock);
+	}
+	env_vm_unlock(curenv);
+	return m;
+}
+
+// Make the system call a submission ring entry asks for.  Only calls
+// that never block can be made this way, so a send to an environment
+// that isn't receiving fails with -E_IPC_NOT_RECV instead of waiting.
+static int32_t
+ring_call(struct RingSqe *sqe)
+{
+	switch (sqe->num)
+	{
+	case SYS_ipc_try_send:
+		return ipc_send(sqe->args[0], sqe->args[1], (void *)sqe->args[2],
+										sqe->args[3], 0);
+	case SYS_page_alloc:
+	case SYS_page_map:
+	case SYS_page_unmap:
+	case SYS_net_send:
+	case SYS_net_recv:
+		return syscall(sqe->num, sqe->args[0], sqe->args[1],
+									 sqe->args[2], sqe->args[3], sqe->args[4]);
+	default:
+		return -E_INVAL;
+	}
+}
+
+// Make the system calls waiting in curenv's submission ring, as many
+// as there is room for in its completion ring, up to NRING of them.
+// The entries are copied a chunk at a time, since the calls take the
+// page table lock we would need to hold to use the ring directly.
+// If the ring isn't writable right now (say it is copy-on-write after
+// a fork), leaves it for next time.
+// Returns the number of calls made.
+int
+syscall_ring_drain(void)
+{
+	struct SyscallRing *ring = curenv->env_ring;
+	struct RingSqe sqe[16];
+	int32_t result[16];
+	uint32_t head, n, i, total;
+
+	for (total = 0; ring && total < NRING; total += n)
+	{
+		env_vm_lock(curenv);
+		if (user_mem_check(curenv, ring, sizeof(*ring), PTE_U | PTE_W) < 0)
+		{
+			env_vm_unlock(curenv);
+			break;
+		}
+		head = ring->sq_head;
+		n = MIN(ring->sq_tail - head, NRING - (ring->cq_tail - ring->cq_head));
+		n = MIN(n, MIN(ARRAY_SIZE(sqe), NRING - total));
+		for (i = 0; i < n; i++)
+			sqe[i] = ring->sq[(head + i) % NRING];
+		ring->sq_head = head + n;
+		env_vm_unlock(curenv);
+		if (n == 0)
+			break;
+
+		for (i = 0; i < n; i++)
+			result[i] = ring_call(&sqe[i]);
+
+		// The calls may have taken the ring away, in which case
+		// the completions have nowhere to go
+		env_vm_lock(curenv);
+		if (user_mem_check(curenv, ring, sizeof(*ring), PTE_U | PTE_W) < 0)
+		{
+			env_vm_unlock(curenv);
+			break;
+		}
+		for (i = 0; i < n; i++)
+		{
+			ring->cq[ring->cq_tail % NRING].data = sqe[i].data;
+			ring->cq[ring->cq_tail % NRING].result = result[i];
+			ring->cq_tail++;
+		}
+		env_vm_unlock(curenv);
+	}
+	return total;
+}
+
+// Register the page at 'va' as curenv's SyscallRing, or unregister it
+// if va is 0.  From then on, the kernel makes the calls queued in the
+// ring on every timer interrupt that finds curenv in user mode, and
+// on sys_ring_enter.  The calls that can be queued are the ones that
+// never block: SYS_ipc_try_send, SYS_page_alloc, SYS_page_map,
+// SYS_page_unmap, SYS_net_send and SYS_net_recv.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if va is not page-aligned, is not below UTOP, or is not
+//		mapped writable.
+static int
+sys_ring_setup(struct SyscallRing *va)
+{
+	int r = 0;
+
+	if (va == 0)
+	{
+		curenv->env_ring = 0;
+		return 0;
+	}
+	if ((uintptr_t)va >= UTOP || PGOFF(va))
+		return -E_INVAL;
+	env_vm_lock(curenv);
+	if (user_mem_check(curenv, va, sizeof(*va), PTE_U | PTE_W) < 0)
+		r = -E_INVAL;
+	else
+		curenv->env_ring = va;
+	env_vm_unlock(curenv);
+	return r;
+}
+
+// Make the system calls waiting in curenv's ring now.
+// Returns the number of calls made.
+static int
+sys_ring_enter(void)
+{
+	return syscall_ring_drain();
+}
+
 static int
 sys_read_mac(uint8_t *mac_addr)
 {
-	user_mem_assert(curenv, mac_addr, 6, PTE_W);
+	user_mem_hold(mac_addr, 6, PTE_W);
 	memmove(mac_addr, e1000_mac_address, 6);
+	env_vm_unlock(curenv);
 	return 0;
 }
 
-int32_t
-_syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5, struct Trapframe *tf)
+// System calls that take no locks and never block, yield or destroy
+// the caller.  These can run before anything else is done on kernel
+// entry, not even saving the caller's registers, since the caller
+// always gets to return from them right away.
+// Returns true and sets *ret if syscallno is one of these, unless
+// curenv is traced: traced calls have to go the slow way.
+bool
+syscall_fast(uint32_t syscallno, int32_t *ret)
 {
-	int ret;
+	if (traced(curenv))
+		return 0;
+	switch (syscallno)
+	{
+	case SYS_getenvid:
+		*ret = sys_getenvid();
+		return 1;
+	case SYS_time_msec:
+		*ret = sys_time_msec();
+		return 1;
+	default:
+		return 0;
+	}
+}
 
-	lock_kernel();
-	curenv->env_tf = *tf;
-	ret = syscall(syscallno, a1, a2, a3, a4, a5);
-	unlock_kernel();
+// A system call made with sysenter.  lib/syscall.c leaves the fifth
+// argument on the user stack, just above where tf_esp points.
+int32_t
+_syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, struct Trapframe *tf)
+{
+	uint32_t *a5p = (uint32_t *)(tf->tf_esp + 4), a5;
+	int32_t ret;
+
+	if (syscall_fast(syscallno, &ret))
+		return ret;
+	// The stack pointer came from the user, so check it before
+	// reading through it
+	user_mem_hold(a5p, sizeof(a5), 0);
+	a5 = *a5p;
+	env_vm_unlock(curenv);
+	// No need to save tf: it already is curenv->env_tf
+	return syscall(syscallno, a1, a2, a3, a4, a5);
+}
 
+// Makes a system call, recording it in the trace if curenv is traced.
+int32_t
+syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5)
+{
+	uint32_t seq;
+	int32_t ret;
+	int cpu;
+
+	if (!traced(curenv))
+		return syscall_dispatch(syscallno, a1, a2, a3, a4, a5);
+	cpu = cpunum();
+	seq = trace_enter(syscallno, a1, a2, a3, a4, a5);
+	ret = syscall_dispatch(syscallno, a1, a2, a3, a4, a5);
+	trace_exit(cpu, seq, ret);
 	return ret;
 }
+
 // Dispatches to the correct kernel function, passing the arguments.
-int32_t
-syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5)
+static int32_t
+syscall_dispatch(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5)
 {
 	// Call the function corresponding to the 'syscallno' parameter.
 	// Return any appropriate return value.
@@ -735,10 +1307,42 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 	{
 		return sys_net_recv((void *)a1, a2);
 	}
-	case SYS_get_mac:
+	case SYS_read_mac:
 	{
 		return sys_read_mac((uint8_t *)a1);
 	}
+	case SYS_env_set_priority:
+	{
+		return sys_env_set_priority((envid_t)a1, (int)a2);
+	}
+	case SYS_env_set_affinity:
+	{
+		return sys_env_set_affinity((envid_t)a1, (uint32_t)a2);
+	}
+	case SYS_sleep_until:
+	{
+		return sys_sleep_until((unsigned int)a1);
+	}
+	case SYS_yield_to:
+	{
+		return sys_yield_to((envid_t)a1);
+	}
+	case SYS_batch:
+	{
+		return sys_batch((struct SyscallOp *)a1, (int)a2);
+	}
+	case SYS_trace:
+	{
+		return sys_trace((int)a1, (struct SyscallTrace *)a2, (int)a3);
+	}
+	case SYS_ring_setup:
+	{
+		return sys_ring_setup((struct SyscallRing *)a1);
+	}
+	case SYS_ring_enter:
+	{
+		return sys_ring_enter();
+	}
 	default:
 	{
 		return -E_INVAL;
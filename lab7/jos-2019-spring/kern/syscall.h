@@ -7,7 +7,9 @@
 #include <inc/syscall.h>
 
 int32_t syscall(uint32_t num, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5);
-int32_t _syscall(uint32_t num, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5, struct Trapframe *tf);
+bool syscall_fast(uint32_t num, int32_t *ret);
+int syscall_ring_drain(void);
+int32_t _syscall(uint32_t num, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, struct Trapframe *tf);
 
 #endif /* !JOS_KERN_SYSCALL_H */
 
@@ -1,26 +1,69 @@
 #include <kern/time.h>
 #include <inc/assert.h>
+#include <inc/x86.h>
+#include <inc/memlayout.h>
 
-static unsigned int ticks;
+// Time is kept by the TSC, which every CPU can read without taking an
+// interrupt.  Its rate is measured once at boot against channel 2 of
+// the 8253 PIT, whose input clock has a known frequency.
+#define PIT_HZ		1193182
+#define PIT_CH2		0x42
+#define PIT_MODE	0x43
+#define PIT_GATE	0x61	// Bit 0: channel 2 gate, bit 5: channel 2 output
+#define CAL_MSEC	10
+
+static uint64_t tsc_boot;
+static uint32_t tsc_per_msec;
+
+// The page mapped read-only at UTIME.  Users can see all of it, so it
+// holds nothing but the struct TimeInfo.
+uint8_t timepage[PGSIZE] __attribute__((aligned(PGSIZE)));
+#define timeinfo ((struct TimeInfo *) timepage)
 
 void
 time_init(void)
 {
-	ticks = 0;
+	uint32_t count = PIT_HZ / 1000 * CAL_MSEC;
+	uint64_t start;
+
+	// Raise the gate with the speaker off, and count down once in
+	// mode 0; the output goes high when the count reaches zero.
+	outb(PIT_GATE, (inb(PIT_GATE) & ~0x02) | 0x01);
+	outb(PIT_MODE, 0xb0);
+	outb(PIT_CH2, count & 0xff);
+	outb(PIT_CH2, count >> 8);
+
+	start = read_tsc();
+	while (!(inb(PIT_GATE) & 0x20))
+		;
+	tsc_per_msec = (read_tsc() - start) / CAL_MSEC;
+	if (tsc_per_msec == 0)
+		panic("time_init: TSC is not running");
+	tsc_boot = read_tsc();
+
+	timeinfo->ti_tsc_boot = tsc_boot;
+	timeinfo->ti_tsc_per_msec = tsc_per_msec;
 }
 
-// This should be called once per timer interrupt.  A timer interrupt
-// fires every 10 ms.
+unsigned int
+time_msec(void)
+{
+	return (read_tsc() - tsc_boot) / tsc_per_msec;
+}
+
+// Spin for 'msec' milliseconds.
 void
-time_tick(void)
+time_delay(unsigned int msec)
 {
-	ticks++;
-	if (ticks * 10 < ticks)
-		panic("time_tick: time overflowed");
+	uint64_t end = read_tsc() + (uint64_t)msec * tsc_per_msec;
+
+	while (read_tsc() < end)
+		;
 }
 
-unsigned int
-time_msec(void)
+// Microseconds since time_init()
+uint64_t
+time_usec(void)
 {
-	return ticks * 10;
+	return (read_tsc() - tsc_boot) * 1000 / tsc_per_msec;
 }
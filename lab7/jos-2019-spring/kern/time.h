@@ -4,8 +4,21 @@
 # error "This is a JOS kernel header; user programs should not #include it"
 #endif
 
+#include <inc/types.h>
+
+// Program the LAPIC timer in one-shot mode for the next scheduling
+// deadline instead of interrupting every TICK_MSEC.
+#define TICKLESS
+
+// Period of the LAPIC timer when it is not tickless, and the unit of
+// scheduler time slices.
+#define TICK_MSEC 10
+
+extern uint8_t timepage[];
+
 void time_init(void);
-void time_tick(void);
 unsigned int time_msec(void);
+uint64_t time_usec(void);
+void time_delay(unsigned int msec);
 
 #endif /* JOS_KERN_TIME_H */
@@ -61,6 +61,8 @@ static const char *trapname(int trapno)
 		return "System call";
 	if (trapno >= IRQ_OFFSET && trapno < IRQ_OFFSET + 16)
 		return "Hardware Interrupt";
+	if (trapno == IRQ_OFFSET + IRQ_RESCHED)
+		return "Reschedule IPI";
 	return "(unknown trap)";
 }
 
@@ -104,10 +106,15 @@ void IRQ14_ENTRY();
 void IRQ15_ENTRY();
 
 void IRQ_ERROR_ENTRY();
+void IRQ_RESCHED_ENTRY();
 void trap_init(void)
 {
 	extern struct Segdesc gdt[];
 
+	// kern/trapentry.S saves user trap frames in curenv->env_tf, and
+	// switch_and_trap finds curenv from them
+	static_assert(offsetof(struct Env, env_tf) == 0);
+
 	// LAB 3: Your code here.
 	SETGATE(idt[T_DIVIDE], 0, GD_KT, T_DIVIDE_ENTRY, 0);
 	SETGATE(idt[T_DEBUG], 0, GD_KT, T_DEBUG_ENTRY, 0);
@@ -148,6 +155,7 @@ void trap_init(void)
 	SETGATE(idt[IRQ_OFFSET + 15], 0, GD_KT, IRQ15_ENTRY, 0);
 
 	SETGATE(idt[IRQ_OFFSET + IRQ_ERROR], 0, GD_KT, IRQ_ERROR_ENTRY, 0);
+	SETGATE(idt[IRQ_OFFSET + IRQ_RESCHED], 0, GD_KT, IRQ_RESCHED_ENTRY, 0);
 	// Per-CPU setup
 	trap_init_percpu();
 }
@@ -190,9 +198,17 @@ void trap_init_percpu(void)
 	thiscpu->cpu_ts.ts_ss0 = GD_KD;
 	thiscpu->cpu_ts.ts_iomb = sizeof(struct Taskstate);
 
-	// wrmsr(0x174, GD_KT, 0);
-	// wrmsr(0x175, thiscpu->cpu_ts.ts_esp0, 0);
-	// wrmsr(0x176, (uint32_t)sysenter_handler, 0);
+	// sysenter enters the kernel at sysenter_handler, which takes
+	// its stack from ts_esp0 like traps do.  lib/syscall.c falls back
+	// to int $T_SYSCALL if the CPU doesn't have it.
+	uint32_t features;
+	cpuid(1, NULL, NULL, NULL, &features);
+	if (features & CPUID_SEP)
+	{
+		wrmsr(MSR_SYSENTER_CS, GD_KT, 0);
+		wrmsr(MSR_SYSENTER_ESP, (uint32_t)&thiscpu->cpu_ts.ts_esp0, 0);
+		wrmsr(MSR_SYSENTER_EIP, (uint32_t)sysenter_handler, 0);
+	}
 	// Initialize the TSS slot of the gdt.
 	// gdt[GD_TSS0 >> 3] = SEG16(STS_T32A, (uint32_t)(&ts),
 	// 													sizeof(struct Taskstate) - 1, 0);
@@ -274,13 +290,17 @@ trap_dispatch(struct Trapframe *tf)
 	}
 	case T_SYSCALL:
 	{
-		tf->tf_regs.reg_eax = syscall(
-				tf->tf_regs.reg_eax,
-				tf->tf_regs.reg_edx,
-				tf->tf_regs.reg_ecx,
-				tf->tf_regs.reg_ebx,
-				tf->tf_regs.reg_edi,
-				tf->tf_regs.reg_esi);
+		int32_t ret;
+
+		if (!syscall_fast(tf->tf_regs.reg_eax, &ret))
+			ret = syscall(
+					tf->tf_regs.reg_eax,
+					tf->tf_regs.reg_edx,
+					tf->tf_regs.reg_ecx,
+					tf->tf_regs.reg_ebx,
+					tf->tf_regs.reg_edi,
+					tf->tf_regs.reg_esi);
+		tf->tf_regs.reg_eax = ret;
 		return;
 	}
 	default:
@@ -298,20 +318,29 @@ trap_dispatch(struct Trapframe *tf)
 		return;
 	}
 
-	// Add time tick increment to clock interrupts.
-	// Be careful! In multiprocessors, clock interrupts are
-	// triggered on every CPU.
-	// LAB 6: Your code here.
-
 	// Handle clock interrupts. Don't forget to acknowledge the
 	// interrupt using lapic_eoi() before calling the scheduler!
 	// LAB 4: Your code here.
+	// Time itself comes from the TSC (see kern/time.c), so there is
+	// no tick to count here.
 
 	if (tf->tf_trapno == IRQ_OFFSET + IRQ_TIMER)
 	{
-		time_tick();
 		lapic_eoi();
-		sched_yield();
+		// Make the calls the environment queued while it ran
+		if ((tf->tf_cs & 3) == 3 && curenv->env_ring)
+			syscall_ring_drain();
+		if (sched_tick())
+			sched_yield();
+		return;
+	}
+
+	// Another CPU queued work for this one (see sched_preempt).
+	if (tf->tf_trapno == IRQ_OFFSET + IRQ_RESCHED)
+	{
+		lapic_eoi();
+		if (sched_ipi())
+			sched_yield();
 		return;
 	}
 
@@ -356,10 +385,8 @@ void trap(struct Trapframe *tf)
 	if (panicstr)
 		asm volatile("hlt");
 
-	// Re-acqurie the big kernel lock if we were halted in
-	// sched_yield()
-	if (xchg(&thiscpu->cpu_status, CPU_STARTED) == CPU_HALTED)
-		lock_kernel();
+	// We are no longer halted in sched_halt(), if we were
+	xchg(&thiscpu->cpu_status, CPU_STARTED);
 	// Check that interrupts are disabled.  If this assertion
 	// fails, DO NOT be tempted to fix it by inserting a "cli" in
 	// the interrupt path.
@@ -368,26 +395,20 @@ void trap(struct Trapframe *tf)
 	if ((tf->tf_cs & 3) == 3)
 	{
 		// Trapped from user mode.
-		// Acquire the big kernel lock before doing any
-		// serious kernel work.
+		// There is no big kernel lock to take: each subsystem
+		// locks what it touches (see kern/spinlock.h).
 		// LAB 4: Your code here.
 		assert(curenv);
-		lock_kernel();
 
 		// Garbage collect if current enviroment is a zombie
+		// (sched_yield frees it)
 		if (curenv->env_status == ENV_DYING)
-		{
-			env_free(curenv);
-			curenv = NULL;
 			sched_yield();
-		}
 
-		// Copy trap frame (which is currently on the stack)
-		// into 'curenv->env_tf', so that running the environment
-		// will restart at the trap point.
-		curenv->env_tf = *tf;
-		// The trapframe on the stack should be ignored from here on.
-		tf = &curenv->env_tf;
+		// The entry code saved the trap frame straight into
+		// 'curenv->env_tf' (see kern/trapentry.S), so running the
+		// environment will restart at the trap point.
+		assert(tf == &curenv->env_tf);
 	}
 
 	// Record that tf is the last real trapframe so
@@ -399,8 +420,10 @@ void trap(struct Trapframe *tf)
 
 	// If we made it to this point, then no other environment was
 	// scheduled, so we should return to the current environment
-	// if doing so makes sense.
-	if (curenv && curenv->env_status == ENV_RUNNING)
+	// if doing so makes sense.  (If curenv blocked, another CPU may
+	// already have woken it and be running it.)
+	if (curenv && curenv->env_status == ENV_RUNNING &&
+			curenv->env_cpunum == cpunum())
 		env_run(curenv);
 	else
 		sched_yield();
@@ -484,27 +507,56 @@ void page_fault_handler(struct Trapframe *tf)
 	print_trapframe(tf);
 	env_destroy(curenv);
 }
+
+// The environment whose env_tf is 'frame'.  The address goes through
+// a variable, or gcc sees a cast from the packed Trapframe and warns.
+// Always inlined, since the callers run on the user page tables.
+static inline __attribute__((always_inline)) struct Env *
+frame_env(struct Trapframe *frame)
+{
+	uintptr_t va = (uintptr_t)frame;
+
+	return (struct Env *)(va - offsetof(struct Env, env_tf));
+}
+
 __user_mapped_text void
 switch_and_trap(struct Trapframe *frame)
 {
 	// LAB7: Your code here
 	if ((frame->tf_cs & 3) == 3)
 	{
-		// Calculate the current CPU core number
-		int cpunum = -1;
 		// Load the physical address of kernel page table
-		// Switch to the kernel page table
-		for (int i = 0; i <= NCPU; i++)
-		{
-			if (((uintptr_t)frame < (KSTACKTOP - i * (KSTKSIZE + KSTKGAP))) && ((uintptr_t)frame >= (KSTACKTOP - (i + 1) * (KSTKSIZE + KSTKGAP))))
-			{
-				cpunum = i;
-				break;
-			}
-		}
-		struct Env *cur_env = (&cpus[cpunum])->cpu_env;
-		lcr3(PADDR(cur_env->env_kern_pgdir));
+		// Switch to the kernel page table.  A frame from user mode
+		// is curenv->env_tf.
+		struct Env *cur_env = frame_env(frame);
+		if (!cur_env->env_nokpti)
+			lcr3(PADDR(cur_env->env_kern_pgdir));
 	}
 
 	trap(frame);
 }
+
+// Called by sysenter_handler with the environment's page tables still
+// loaded.  Switches to the kernel's view for the system call, and back
+// again for the sysexit if the call returns.
+__user_mapped_text int32_t
+switch_and_syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3,
+									 uint32_t a4, struct Trapframe *frame)
+{
+	struct Env *cur_env = frame_env(frame); // frame is curenv->env_tf
+	int32_t ret;
+
+	// getenvid only needs the Env, which the user page tables map, so
+	// it skips both page table switches.  The other fast calls need
+	// the kernel's TSC calibration and libgcc's 64-bit divide, which
+	// they don't, so those go through syscall_fast after the switch.
+	if (syscallno == SYS_getenvid && !cur_env->env_tracer)
+		return cur_env->env_id;
+	if (cur_env->env_nokpti)
+		return _syscall(syscallno, a1, a2, a3, a4, frame);
+	lcr3(PADDR(cur_env->env_kern_pgdir));
+	ret = _syscall(syscallno, a1, a2, a3, a4, frame);
+	// If it returns, cur_env is still running here
+	lcr3(PADDR(cur_env->env_pgdir));
+	return ret;
+}
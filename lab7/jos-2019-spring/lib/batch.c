@@ -0,0 +1,94 @@
+// Queue up system calls to make with a single sys_batch call, for code
+// like fork and spawn that sets up an address space one page at a time.
+
+#include <inc/lib.h>
+
+// The queue fills exactly one page, so it's easy to tell whether a
+// call would change our mapping of it.
+#define NBATCH (PGSIZE / sizeof(struct SyscallOp))
+
+static struct SyscallOp batch[NBATCH] __attribute__((aligned(PGSIZE)));
+static int nbatch;
+// Who queued the calls.  A child of fork starts with a copy of its
+// parent's queue, which it must not make.
+static envid_t batch_owner;
+
+// Would system call 'num' change our own mapping of the queue?
+static bool
+remaps_queue(uint32_t num, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4)
+{
+	envid_t self = thisenv->env_id;
+
+	switch (num)
+	{
+	case SYS_page_alloc:
+	case SYS_page_unmap:
+		return (a1 == 0 || a1 == self) && a2 == (uint32_t)batch;
+	case SYS_page_map:
+		return (a3 == 0 || a3 == self) && a4 == (uint32_t)batch;
+	default:
+		return 0;
+	}
+}
+
+// Queue system call 'num' with arguments a1 to a5, to be made by the
+// next batch_flush().  Only the system calls sys_batch accepts may be
+// queued.  Returns 0, or if calls had to be made first to make room,
+// what batch_flush() returned.
+int batch_add(uint32_t num, uint32_t a1, uint32_t a2, uint32_t a3,
+							uint32_t a4, uint32_t a5)
+{
+	int r;
+
+	if (batch_owner != thisenv->env_id)
+	{
+		nbatch = 0;
+		batch_owner = thisenv->env_id;
+	}
+
+	if (remaps_queue(num, a1, a2, a3, a4))
+	{
+		// sys_batch writes the results back into the queue, so it
+		// can't be what makes the queue read-only.  Make this one
+		// on its own.
+		if ((r = batch_flush()) < 0)
+			return r;
+		if (num == SYS_page_map)
+			return sys_page_map(a1, (void *)a2, a3, (void *)a4, a5);
+		if (num == SYS_page_alloc)
+			return sys_page_alloc(a1, (void *)a2, a3);
+		return sys_page_unmap(a1, (void *)a2);
+	}
+
+	if (nbatch == NBATCH && (r = batch_flush()) < 0)
+		return r;
+	batch[nbatch].num = num;
+	batch[nbatch].args[0] = a1;
+	batch[nbatch].args[1] = a2;
+	batch[nbatch].args[2] = a3;
+	batch[nbatch].args[3] = a4;
+	batch[nbatch].args[4] = a5;
+	nbatch++;
+	return 0;
+}
+
+// Make all the queued system calls.  Returns 0 if they all succeeded,
+// or what the first one to fail returned, in which case the calls
+// queued after it are dropped.
+int batch_flush(void)
+{
+	int n = nbatch, r;
+
+	nbatch = 0;
+	if (n == 0 || batch_owner != thisenv->env_id)
+		return 0;
+	if ((r = sys_batch(batch, n)) < 0)
+		return r;
+	return r < n ? batch[r].result : 0;
+}
+
+// Drop all the queued system calls without making them.
+void batch_discard(void)
+{
+	nbatch = 0;
+}
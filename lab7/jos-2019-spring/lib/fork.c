@@ -67,6 +67,9 @@ pgfault(struct UTrapframe *utf)
 // copy-on-write again if it was already copy-on-write at the beginning of
 // this function?)
 //
+// The mappings are queued with batch_add(), so they may not be made
+// until the caller calls batch_flush().
+//
 // Returns: 0 on success, < 0 on error.
 // It is also OK to panic on error.
 //
@@ -75,28 +78,28 @@ duppage(envid_t envid, unsigned pn)
 {
 	int r;
 	// LAB 4: Your code here.
-	void *addr = (void *)(pn * PGSIZE);
+	uint32_t addr = pn * PGSIZE;
 	if (uvpt[pn] & PTE_SHARE)
 	{
-		if ((r = sys_page_map((envid_t)0, addr, envid, addr, uvpt[pn] & PTE_SYSCALL)) < 0)
+		if ((r = batch_add(SYS_page_map, 0, addr, envid, addr, uvpt[pn] & PTE_SYSCALL)) < 0)
 		{
 			panic("sys_page_map: %e\n", r);
 		}
 	}
 	else if ((uvpt[pn] & PTE_W) || (uvpt[pn] & PTE_COW))
 	{
-		if ((r = sys_page_map((envid_t)0, addr, envid, addr, PTE_U | PTE_P | PTE_COW)) < 0)
+		if ((r = batch_add(SYS_page_map, 0, addr, envid, addr, PTE_U | PTE_P | PTE_COW)) < 0)
 		{
 			panic("sys_page_map: %e\n", r);
 		}
-		if ((r = sys_page_map((envid_t)0, addr, (envid_t)0, addr, PTE_U | PTE_P | PTE_COW)) < 0)
+		if ((r = batch_add(SYS_page_map, 0, addr, 0, addr, PTE_U | PTE_P | PTE_COW)) < 0)
 		{
 			panic("sys_page_map: %e\n", r);
 		}
 	}
 	else
 	{
-		if ((r = sys_page_map((envid_t)0, addr, envid, addr, PTE_U | PTE_P)) < 0)
+		if ((r = batch_add(SYS_page_map, 0, addr, envid, addr, PTE_U | PTE_P)) < 0)
 		{
 			panic("sys_page_map: %e\n", r);
 		}
@@ -141,6 +144,11 @@ fork(void)
 		return 0;
 	}
 
+	if ((r = sys_env_set_pgfault_upcall(envid, _pgfault_upcall)) < 0)
+	{
+		panic("sys_env_set_pgfault_upcall: %e\n", r);
+	}
+
 	for (addr = 0; addr < UTOP; addr += PGSIZE)
 	{
 		if ((uvpd[PDX(addr)] & PTE_P) && (uvpt[PGNUM(addr)] & PTE_P) && addr != UXSTACKTOP - PGSIZE)
@@ -149,19 +157,20 @@ fork(void)
 		}
 	}
 
-	if ((r = sys_page_alloc(envid, (void *)(UXSTACKTOP - PGSIZE), PTE_P | PTE_U | PTE_W)) < 0)
+	if ((r = batch_add(SYS_page_alloc, envid, UXSTACKTOP - PGSIZE, PTE_P | PTE_U | PTE_W, 0, 0)) < 0)
 	{
 		panic("sys_page_alloc: %e\n", r);
 	}
 
-	if ((r = sys_env_set_pgfault_upcall(envid, _pgfault_upcall)) < 0)
+	if ((r = batch_add(SYS_env_set_status, envid, ENV_RUNNABLE, 0, 0, 0)) < 0)
 	{
-		panic("sys_env_set_pgfault_upcall: %e\n", r);
+		panic("sys_env_set_status: %e\n", r);
 	}
 
-	if ((r = sys_env_set_status(envid, ENV_RUNNABLE)) < 0)
+	// Make all the calls queued above in one go
+	if ((r = batch_flush()) < 0)
 	{
-		panic("sys_env_set_status: %e\n", r);
+		panic("fork: %e\n", r);
 	}
 
 	return envid;
@@ -187,13 +196,18 @@ int sfork(void)
 		return 0;
 	}
 
+	if ((r = sys_env_set_pgfault_upcall(envid, _pgfault_upcall)) < 0)
+	{
+		panic("sys_env_set_pgfault_upcall: %e\n", r);
+	}
+
 	for (addr = 0; addr < UTOP; addr += PGSIZE)
 	{
 		if (addr != UXSTACKTOP - PGSIZE && addr != USTACKTOP - PGSIZE)
 		{
 			if ((uvpd[PDX(addr)] & PTE_P) && (uvpt[PGNUM(addr)] & PTE_P))
 			{
-				if ((r = sys_page_map(0, (void *)addr, envid, (void *)addr, uvpt[PGNUM(addr)] & PTE_SYSCALL)) < 0)
+				if ((r = batch_add(SYS_page_map, 0, addr, envid, addr, uvpt[PGNUM(addr)] & PTE_SYSCALL)) < 0)
 				{
 					panic("sys_page_map: %e\n", r);
 				}
@@ -206,19 +220,20 @@ int sfork(void)
 		panic("duppage: %e\n", r);
 	}
 
-	if ((r = sys_page_alloc(envid, (void *)(UXSTACKTOP - PGSIZE), PTE_P | PTE_U | PTE_W)) < 0)
+	if ((r = batch_add(SYS_page_alloc, envid, UXSTACKTOP - PGSIZE, PTE_P | PTE_U | PTE_W, 0, 0)) < 0)
 	{
 		panic("sys_page_alloc: %e\n", r);
 	}
 
-	if ((r = sys_env_set_pgfault_upcall(envid, _pgfault_upcall)) < 0)
+	if ((r = batch_add(SYS_env_set_status, envid, ENV_RUNNABLE, 0, 0, 0)) < 0)
 	{
-		panic("sys_env_set_pgfault_upcall: %e\n", r);
+		panic("sys_env_set_status: %e\n", r);
 	}
 
-	if ((r = sys_env_set_status(envid, ENV_RUNNABLE)) < 0)
+	// Make all the calls queued above in one go
+	if ((r = batch_flush()) < 0)
 	{
-		panic("sys_env_set_status: %e\n", r);
+		panic("fork: %e\n", r);
 	}
 
 	return envid;
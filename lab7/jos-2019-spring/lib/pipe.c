@@ -22,6 +22,8 @@ struct Dev devpipe =
 struct Pipe {
 	off_t p_rpos;		// read position
 	off_t p_wpos;		// write position
+	envid_t p_reader;	// last env to read, to hand off to when full
+	envid_t p_writer;	// last env to write, to hand off to when empty
 	uint8_t p_buf[PIPEBUFSIZ];	// data buffer
 };
 
@@ -114,6 +116,7 @@ devpipe_read(struct Fd *fd, void *vbuf, size_t n)
 			thisenv->env_id, uvpt[PGNUM(p)], n, p->p_rpos, p->p_wpos);
 
 	buf = vbuf;
+	p->p_reader = thisenv->env_id;
 	for (i = 0; i < n; i++) {
 		while (p->p_rpos == p->p_wpos) {
 			// pipe is empty
@@ -123,10 +126,10 @@ devpipe_read(struct Fd *fd, void *vbuf, size_t n)
 			// if all the writers are gone, note eof
 			if (_pipeisclosed(fd, p))
 				return 0;
-			// yield and see what happens
+			// let the writer run and see what happens
 			if (debug)
-				cprintf("devpipe_read yield\n");
-			sys_yield();
+				cprintf("devpipe_read yield to %08x\n", p->p_writer);
+			sys_yield_to(p->p_writer);
 		}
 		// there's a byte.  take it.
 		// wait to increment rpos until the byte is taken!
@@ -149,6 +152,7 @@ devpipe_write(struct Fd *fd, const void *vbuf, size_t n)
 			thisenv->env_id, uvpt[PGNUM(p)], n, p->p_rpos, p->p_wpos);
 
 	buf = vbuf;
+	p->p_writer = thisenv->env_id;
 	for (i = 0; i < n; i++) {
 		while (p->p_wpos >= p->p_rpos + sizeof(p->p_buf)) {
 			// pipe is full
@@ -157,10 +161,10 @@ devpipe_write(struct Fd *fd, const void *vbuf, size_t n)
 			// note eof
 			if (_pipeisclosed(fd, p))
 				return 0;
-			// yield and see what happens
+			// let the reader run and see what happens
 			if (debug)
-				cprintf("devpipe_write yield\n");
-			sys_yield();
+				cprintf("devpipe_write yield to %08x\n", p->p_reader);
+			sys_yield_to(p->p_reader);
 		}
 		// there's room for a byte.  store it.
 		// wait to increment wpos until the byte is stored!
@@ -0,0 +1,75 @@
+// Asynchronous system calls, through a SyscallRing shared with the
+// kernel (see sys_ring_setup in kern/syscall.c).  The kernel makes the
+// calls queued with ring_submit() on the next timer interrupt, or right
+// away on sys_ring_enter(), and ring_reap() collects the results.
+
+#include <inc/lib.h>
+
+static struct SyscallRing ring __attribute__((aligned(PGSIZE)));
+// Who registered the ring.  A child of fork starts with a copy of its
+// parent's ring, which the kernel doesn't know about.
+static envid_t ring_owner;
+
+static int
+ring_init(void)
+{
+	int r;
+
+	if (ring_owner == thisenv->env_id)
+		return 0;
+	// Writing the ring first also gives us a private copy of it if
+	// it is copy-on-write, which the kernel wouldn't accept
+	memset(&ring, 0, sizeof(ring));
+	if ((r = sys_ring_setup(&ring)) < 0)
+		return r;
+	ring_owner = thisenv->env_id;
+	return 0;
+}
+
+// Queue system call 'num' with arguments a1 to a5.  Its completion
+// will carry 'data'.  If the submission ring is full, has the kernel
+// make the calls in it first.
+// Returns 0 on success, -E_AGAIN if the completion ring is full too,
+// or another error from setting up the ring.
+int ring_submit(uint32_t num, uint32_t a1, uint32_t a2, uint32_t a3,
+		uint32_t a4, uint32_t a5, uint32_t data)
+{
+	struct RingSqe *sqe;
+	int r;
+
+	if ((r = ring_init()) < 0)
+		return r;
+	while (ring.sq_tail - ring.sq_head == NRING)
+		if ((r = sys_ring_enter()) <= 0)
+			return r < 0 ? r : -E_AGAIN;
+
+	sqe = &ring.sq[ring.sq_tail % NRING];
+	sqe->num = num;
+	sqe->args[0] = a1;
+	sqe->args[1] = a2;
+	sqe->args[2] = a3;
+	sqe->args[3] = a4;
+	sqe->args[4] = a5;
+	sqe->data = data;
+	// The entry must be complete before the kernel can see it
+	asm volatile("" : : : "memory");
+	ring.sq_tail++;
+	return 0;
+}
+
+// Take the oldest completion, if there is one, storing the 'data' it
+// was submitted with in *data_store and the call's result in
+// *result_store.  Returns 1 if there was a completion, 0 if not.
+int ring_reap(uint32_t *data_store, int32_t *result_store)
+{
+	struct RingCqe *cqe;
+
+	if (ring_owner != thisenv->env_id || ring.cq_head == ring.cq_tail)
+		return 0;
+	cqe = &ring.cq[ring.cq_head % NRING];
+	*data_store = cqe->data;
+	*result_store = cqe->result;
+	asm volatile("" : : : "memory");
+	ring.cq_head++;
+	return 1;
+}
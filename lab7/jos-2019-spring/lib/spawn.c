@@ -139,6 +139,8 @@ int spawn(const char *prog, const char **argv)
 	return child;
 
 error:
+	// Get rid of any calls still queued for the child
+	batch_discard();
 	sys_env_destroy(child);
 	close(fd);
 	return r;
@@ -242,6 +244,8 @@ int exec(const char *prog, const char **argv)
 	return 0;
 
 error:
+	// Get rid of any calls still queued for the child
+	batch_discard();
 	sys_env_destroy(child);
 	close(fd);
 	return r;
@@ -377,26 +381,38 @@ map_segment(envid_t child, uintptr_t va, size_t memsz,
 		fileoffset -= i;
 	}
 
+	// Blank pages are queued with batch_add() and allocated by the
+	// next batch_flush().  Each page from the file is read into a
+	// fresh page at UTEMP, which is then moved into the child and
+	// replaced with the next fresh page in a single batch (or just
+	// unmapped, after the last one).
+	if (filesz > 0 && (r = sys_page_alloc(0, UTEMP, PTE_P | PTE_U | PTE_W)) < 0)
+		return r;
 	for (i = 0; i < memsz; i += PGSIZE)
 	{
 		if (i >= filesz)
 		{
 			// allocate a blank page
-			if ((r = sys_page_alloc(child, (void *)(va + i), perm)) < 0)
+			if ((r = batch_add(SYS_page_alloc, child, va + i, perm, 0, 0)) < 0)
 				return r;
 		}
 		else
 		{
 			// from file
-			if ((r = sys_page_alloc(0, UTEMP, PTE_P | PTE_U | PTE_W)) < 0)
-				return r;
 			if ((r = seek(fd, fileoffset + i)) < 0)
 				return r;
 			if ((r = readn(fd, UTEMP, MIN(PGSIZE, filesz - i))) < 0)
 				return r;
-			if ((r = sys_page_map(0, UTEMP, child, (void *)(va + i), perm)) < 0)
+			if ((r = batch_add(SYS_page_map, 0, (uint32_t)UTEMP, child, va + i, perm)) < 0)
 				panic("spawn: sys_page_map data: %e", r);
-			sys_page_unmap(0, UTEMP);
+			if (i + PGSIZE < filesz)
+				r = batch_add(SYS_page_alloc, 0, (uint32_t)UTEMP, PTE_P | PTE_U | PTE_W, 0, 0);
+			else
+				r = batch_add(SYS_page_unmap, 0, (uint32_t)UTEMP, 0, 0, 0);
+			if (r < 0)
+				return r;
+			if ((r = batch_flush()) < 0)
+				return r;
 		}
 	}
 	return 0;
@@ -417,12 +433,13 @@ copy_shared_pages(envid_t child)
 				(uvpt[PGNUM(addr)] & PTE_U) &&
 				(uvpt[PGNUM(addr)] & PTE_SHARE))
 		{
-			if ((r = sys_page_map((envid_t)0, (void *)addr, child, (void *)addr, uvpt[PGNUM(addr)] & PTE_SYSCALL)) < 0)
+			if ((r = batch_add(SYS_page_map, 0, addr, child, addr, uvpt[PGNUM(addr)] & PTE_SYSCALL)) < 0)
 			{
 				panic("sys_page_map: %e\n", r);
 			}
 		}
 	}
-	return 0;
+	// Also makes the allocations map_segment queued
+	return batch_flush();
 }
 
@@ -2,15 +2,22 @@
 
 #include <inc/syscall.h>
 #include <inc/lib.h>
+#include <inc/x86.h>
+
+// Whether the CPU has sysenter, which enters the kernel much faster
+// than an interrupt; -1 until we've checked.
+static int has_sysenter = -1;
 
 static inline int32_t
 syscall(int num, int check, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5)
 {
 	int32_t ret;
+	uint32_t features;
 
 	// Generic system call: pass system call number in AX,
 	// up to five parameters in DX, CX, BX, DI, SI.
-	// Interrupt kernel with T_SYSCALL.
+	// Enter the kernel with sysenter if we can, and otherwise
+	// interrupt it with T_SYSCALL.
 	//
 	// The "volatile" tells the assembler not to optimize
 	// this instruction away just because we don't use the
@@ -20,36 +27,61 @@ syscall(int num, int check, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 	// potentially change the condition codes and arbitrary
 	// memory locations.
 
-	asm volatile("pushl %%ecx\n\t"
-							 "pushl %%edx\n\t"
-							 "pushl %%ebx\n\t"
-							 "pushl %%esp\n\t"
-							 "pushl %%ebp\n\t"
-							 "pushl %%esi\n\t"
-							 "pushl %%edi\n\t"
-
-							 "pushl %%esp\n\t"
-							 "popl %%ebp\n\t"
-							 "leal after_sysenter_label%=, %%esi\n\t"
-							 "sysenter\n\t"
-							 "after_sysenter_label%=:\n\t"
-
-							 "popl %%edi\n\t"
-							 "popl %%esi\n\t"
-							 "popl %%ebp\n\t"
-							 "popl %%esp\n\t"
-							 "popl %%ebx\n\t"
-							 "popl %%edx\n\t"
-							 "popl %%ecx\n\t"
-
-							 : "=a"(ret)
-							 : "a"(num),
-								 "d"(a1),
-								 "c"(a2),
-								 "b"(a3),
-								 "D"(a4),
-								 "S"(a5)
-							 : "cc", "memory");
+	if (has_sysenter < 0)
+	{
+		cpuid(1, NULL, NULL, NULL, &features);
+		has_sysenter = (features & CPUID_SEP) != 0;
+	}
+
+	if (has_sysenter)
+	{
+		// sysenter doesn't save the stack pointer or return address, so
+		// pass them in %ebp and %esi for sysexit, and save the rest of
+		// the registers the kernel uses on the way.
+		asm volatile("pushl %%ecx\n\t"
+								 "pushl %%edx\n\t"
+								 "pushl %%ebx\n\t"
+								 "pushl %%esp\n\t"
+								 "pushl %%ebp\n\t"
+								 "pushl %%esi\n\t"
+								 "pushl %%edi\n\t"
+
+								 "pushl %%esp\n\t"
+								 "popl %%ebp\n\t"
+								 "leal after_sysenter_label%=, %%esi\n\t"
+								 "sysenter\n\t"
+								 "after_sysenter_label%=:\n\t"
+
+								 "popl %%edi\n\t"
+								 "popl %%esi\n\t"
+								 "popl %%ebp\n\t"
+								 "popl %%esp\n\t"
+								 "popl %%ebx\n\t"
+								 "popl %%edx\n\t"
+								 "popl %%ecx\n\t"
+
+								 : "=a"(ret)
+								 : "a"(num),
+									 "d"(a1),
+									 "c"(a2),
+									 "b"(a3),
+									 "D"(a4),
+									 "S"(a5)
+								 : "cc", "memory");
+	}
+	else
+	{
+		asm volatile("int %1\n"
+								 : "=a"(ret)
+								 : "i"(T_SYSCALL),
+									 "a"(num),
+									 "d"(a1),
+									 "c"(a2),
+									 "b"(a3),
+									 "D"(a4),
+									 "S"(a5)
+								 : "cc", "memory");
+	}
 
 	if (check && ret > 0)
 		panic("syscall %d returned %d (> 0)", num, ret);
@@ -135,10 +167,12 @@ int sys_sbrk(uint32_t inc)
 	return syscall(SYS_sbrk, 0, (uint32_t)inc, (uint32_t)0, 0, 0, 0);
 }
 
+// The kernel keeps its time in the TSC and publishes the calibration at
+// UTIME, so there is no need to trap to read it.
 unsigned int
 sys_time_msec(void)
 {
-	return (unsigned int)syscall(SYS_time_msec, 0, 0, 0, 0, 0, 0);
+	return (read_tsc() - timeinfo.ti_tsc_boot) / timeinfo.ti_tsc_per_msec;
 }
 
 int sys_net_send(const void *buf, uint32_t len)
@@ -161,3 +195,43 @@ int sys_read_mac(uint8_t *mac_addr)
 	return syscall(SYS_read_mac, 1, (uint32_t)mac_addr, 0, 0, 0, 0);
 }
 
+int sys_env_set_priority(envid_t envid, int prio)
+{
+	return syscall(SYS_env_set_priority, 1, envid, prio, 0, 0, 0);
+}
+
+int sys_env_set_affinity(envid_t envid, uint32_t cpumask)
+{
+	return syscall(SYS_env_set_affinity, 1, envid, cpumask, 0, 0, 0);
+}
+
+int sys_sleep_until(unsigned int msec)
+{
+	return syscall(SYS_sleep_until, 0, msec, 0, 0, 0, 0);
+}
+
+
+int sys_yield_to(envid_t envid)
+{
+	return syscall(SYS_yield_to, 0, envid, 0, 0, 0, 0);
+}
+
+int sys_batch(struct SyscallOp *ops, int n)
+{
+	return syscall(SYS_batch, 0, (uint32_t)ops, n, 0, 0, 0);
+}
+
+int sys_trace(int on, struct SyscallTrace *buf, int n)
+{
+	return syscall(SYS_trace, 0, on, (uint32_t)buf, n, 0, 0);
+}
+
+int sys_ring_setup(struct SyscallRing *ring)
+{
+	return syscall(SYS_ring_setup, 0, (uint32_t)ring, 0, 0, 0, 0);
+}
+
+int sys_ring_enter(void)
+{
+	return syscall(SYS_ring_enter, 0, 0, 0, 0, 0, 0);
+}
@@ -47,7 +47,12 @@ thread_wait(volatile uint32_t *addr, uint32_t val, uint32_t msec) {
 	if (cur_tc->tc_wakeup)
 	    break;
 
-	thread_yield();
+	// With no other thread to run, nothing can change *addr or
+	// wake us up before the timeout, so sleep in the kernel.
+	if (!thread_queue.tq_first)
+	    sys_sleep_until(msec);
+	else
+	    thread_yield();
 	p = sys_time_msec();
     }
 
@@ -0,0 +1,67 @@
+// Measure how CPU time is shared between environments that compete
+// in different ways, and how long each waits for the CPU at worst.
+// Child 0 and 1 spin, child 2 yields after a short burst of work,
+// and child 3 spins at ENV_PRIO_LOW.
+
+#include <inc/lib.h>
+
+#define NCHILD		4
+#define RUN_MSEC	2000
+
+static const char *kind[NCHILD] = {
+	"spin", "spin", "yield", "spin, low priority",
+};
+
+static void
+child(int i, unsigned int stop)
+{
+	volatile int j;
+
+	while (sys_time_msec() < stop) {
+		if (i == 2) {
+			for (j = 0; j < 10000; j++)
+				;
+			sys_yield();
+		}
+	}
+	// Stop competing, but stay around so the parent can read our
+	// statistics.
+	while (1)
+		ipc_recv(0, 0, 0);
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t kids[NCHILD];
+	const volatile struct Env *e;
+	unsigned int stop;
+	uint64_t total = 0;
+	int i, r;
+
+	stop = sys_time_msec() + RUN_MSEC;
+	for (i = 0; i < NCHILD; i++) {
+		if ((r = fork()) < 0)
+			panic("fork: %e", r);
+		if (r == 0)
+			child(i, stop);
+		kids[i] = r;
+	}
+	if ((r = sys_env_set_priority(kids[3], ENV_PRIO_LOW)) < 0)
+		panic("sys_env_set_priority: %e", r);
+
+	sys_sleep_until(stop + 100);
+
+	for (i = 0; i < NCHILD; i++)
+		total += envs[ENVX(kids[i])].env_runtime;
+	if (total == 0)
+		panic("children did not run");
+	cprintf("env       share  max wait  kind\n");
+	for (i = 0; i < NCHILD; i++) {
+		e = &envs[ENVX(kids[i])];
+		cprintf("%08x  %3u%%  %5u ms  %s\n", kids[i],
+			(unsigned) (e->env_runtime * 100 / total),
+			(unsigned) (e->env_max_wait / 1000), kind[i]);
+		sys_env_destroy(kids[i]);
+	}
+}
@@ -0,0 +1,55 @@
+// Measure file server throughput: writing and reading back a file,
+// and opening and closing it.  Every operation is an IPC round trip
+// to the file server, so this shows what the server's traps cost
+// (compare with and without KPTI_TRUSTED_SERVERS in kern/kpti.h).
+
+#include <inc/lib.h>
+
+#define FILE_KB	256
+#define NREAD	8
+#define NOPEN	200
+
+static char buf[PGSIZE];
+
+void
+umain(int argc, char **argv)
+{
+	unsigned int start, msec;
+	int fd, i, n, r;
+
+	memset(buf, 'x', sizeof(buf));
+
+	start = sys_time_msec();
+	if ((fd = open("/fsbench", O_RDWR | O_CREAT | O_TRUNC)) < 0)
+		panic("open /fsbench: %e", fd);
+	for (i = 0; i < FILE_KB * 1024 / PGSIZE; i++)
+		if ((r = write(fd, buf, PGSIZE)) != PGSIZE)
+			panic("write: %e", r);
+	close(fd);
+	msec = sys_time_msec() - start;
+	cprintf("write:      %u KB/s\n", FILE_KB * 1000 / MAX(msec, 1));
+
+	start = sys_time_msec();
+	for (i = 0; i < NREAD; i++) {
+		if ((fd = open("/fsbench", O_RDONLY)) < 0)
+			panic("open /fsbench: %e", fd);
+		while ((n = read(fd, buf, PGSIZE)) > 0)
+			;
+		if (n < 0)
+			panic("read: %e", n);
+		close(fd);
+	}
+	msec = sys_time_msec() - start;
+	cprintf("read:       %u KB/s\n", NREAD * FILE_KB * 1000 / MAX(msec, 1));
+
+	start = sys_time_msec();
+	for (i = 0; i < NOPEN; i++) {
+		if ((fd = open("/fsbench", O_RDONLY)) < 0)
+			panic("open /fsbench: %e", fd);
+		close(fd);
+	}
+	msec = sys_time_msec() - start;
+	cprintf("open+close: %u per second\n", NOPEN * 1000 / MAX(msec, 1));
+
+	remove("/fsbench");
+}
@@ -0,0 +1,180 @@
+// Run a program with syscall tracing on, and print the system calls
+// made by it and the environments it creates until it exits.
+// With -s, print how many calls of each kind there were and how long
+// they took instead.
+
+#include <inc/lib.h>
+
+#define NBUF	128
+#define NLAT	1024	// Latencies kept for each system call
+
+static const struct {
+	const char *name;
+	int nargs;
+} calls[NSYSCALLS] = {
+	[SYS_cputs] = { "cputs", 2 },
+	[SYS_cgetc] = { "cgetc", 0 },
+	[SYS_getenvid] = { "getenvid", 0 },
+	[SYS_env_destroy] = { "env_destroy", 1 },
+	[SYS_page_alloc] = { "page_alloc", 3 },
+	[SYS_page_map] = { "page_map", 5 },
+	[SYS_page_unmap] = { "page_unmap", 2 },
+	[SYS_exofork] = { "exofork", 0 },
+	[SYS_env_set_status] = { "env_set_status", 2 },
+	[SYS_env_set_trapframe] = { "env_set_trapframe", 2 },
+	[SYS_env_set_pgfault_upcall] = { "env_set_pgfault_upcall", 2 },
+	[SYS_yield] = { "yield", 0 },
+	[SYS_ipc_try_send] = { "ipc_try_send", 4 },
+	[SYS_ipc_recv] = { "ipc_recv", 1 },
+	[SYS_map_kernel_page] = { "map_kernel_page", 2 },
+	[SYS_sbrk] = { "sbrk", 1 },
+	[SYS_time_msec] = { "time_msec", 0 },
+	[SYS_net_send] = { "net_send", 2 },
+	[SYS_net_recv] = { "net_recv", 2 },
+	[SYS_exec] = { "exec", 1 },
+	[SYS_read_mac] = { "read_mac", 1 },
+	[SYS_env_set_priority] = { "env_set_priority", 2 },
+	[SYS_env_set_affinity] = { "env_set_affinity", 2 },
+	[SYS_sleep_until] = { "sleep_until", 1 },
+	[SYS_yield_to] = { "yield_to", 1 },
+	[SYS_batch] = { "batch", 2 },
+	[SYS_trace] = { "trace", 3 },
+	[SYS_ring_setup] = { "ring_setup", 1 },
+	[SYS_ring_enter] = { "ring_enter", 0 },
+};
+
+static struct SyscallTrace buf[NBUF];
+static int summary;
+
+// For the summary: calls seen, and the latencies of the first NLAT
+// of them to return, in TSC cycles.
+static uint32_t ncall[NSYSCALLS];
+static uint32_t nlat[NSYSCALLS];
+static uint32_t lat[NSYSCALLS][NLAT];
+
+static void
+record(const struct SyscallTrace *t)
+{
+	int i;
+
+	if (t->num >= NSYSCALLS)
+		return;
+
+	if (summary) {
+		ncall[t->num]++;
+		if (t->tsc_exit && nlat[t->num] < NLAT)
+			lat[t->num][nlat[t->num]++] = t->tsc_exit - t->tsc_enter;
+		return;
+	}
+
+	printf("[%08x] %s(", t->env, calls[t->num].name);
+	for (i = 0; i < calls[t->num].nargs; i++)
+		printf("%s%x", i ? ", " : "", t->args[i]);
+	if (t->tsc_exit)
+		printf(") = %d  <%u cycles>\n", t->result,
+		       (uint32_t)(t->tsc_exit - t->tsc_enter));
+	else
+		printf(") = ?\n");
+}
+
+// Read all the records the kernel has, and leave tracing 'on'.
+static void
+drain(int on)
+{
+	int i, n;
+
+	while ((n = sys_trace(on, buf, NBUF)) > 0)
+		for (i = 0; i < n; i++)
+			record(&buf[i]);
+	if (n < 0)
+		panic("sys_trace: %e", n);
+}
+
+static void
+sort(uint32_t *a, int n)
+{
+	int i, j;
+	uint32_t x;
+
+	for (i = 1; i < n; i++) {
+		x = a[i];
+		for (j = i; j > 0 && a[j - 1] > x; j--)
+			a[j] = a[j - 1];
+		a[j] = x;
+	}
+}
+
+// Convert TSC cycles to nanoseconds.
+static uint32_t
+nsec(uint32_t cycles)
+{
+	return (uint64_t)cycles * 1000000 / timeinfo.ti_tsc_per_msec;
+}
+
+static void
+print_summary(void)
+{
+	int num, n;
+
+	printf("syscall                  calls   p50 ns    p99 ns\n");
+	for (num = 0; num < NSYSCALLS; num++) {
+		if (ncall[num] == 0)
+			continue;
+		printf("%-22s %7u", calls[num].name, ncall[num]);
+		if ((n = nlat[num]) > 0) {
+			sort(lat[num], n);
+			printf("  %7u   %7u\n", nsec(lat[num][n / 2]),
+			       nsec(lat[num][n * 99 / 100]));
+		} else
+			printf("        -         -\n");
+	}
+}
+
+static void
+usage(void)
+{
+	printf("usage: strace [-s] program [arg...]\n");
+	exit();
+}
+
+void
+umain(int argc, char **argv)
+{
+	const volatile struct Env *e;
+	struct Argstate args;
+	envid_t child;
+	int i, r;
+
+	argstart(&argc, argv, &args);
+	while ((i = argnext(&args)) >= 0)
+		switch (i) {
+		case 's':
+			summary = 1;
+			break;
+		default:
+			usage();
+		}
+	if (argc < 2)
+		usage();
+
+	// Throw away anything left over from an earlier trace
+	while ((r = sys_trace(1, buf, NBUF)) > 0)
+		;
+	if (r < 0)
+		panic("sys_trace: %e", r);
+
+	if ((child = spawn(argv[1], (const char **)argv + 1)) < 0) {
+		sys_trace(0, buf, 0);
+		panic("spawn %s: %e", argv[1], child);
+	}
+
+	e = &envs[ENVX(child)];
+	while (e->env_id == child && e->env_status != ENV_FREE) {
+		drain(1);
+		sys_yield();
+	}
+	drain(0);
+
+	if (summary)
+		print_summary();
+}
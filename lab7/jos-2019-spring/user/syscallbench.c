@@ -0,0 +1,85 @@
+// Measure how system call throughput scales with the number of CPUs
+// making calls at once.  sys_getenvid takes no locks at all, while
+// sys_page_unmap takes the caller's page table lock, so any difference
+// in scaling between them comes from locking.
+// Run with CPUS=n to get rows for up to n CPUs.
+
+#include <inc/lib.h>
+
+#define RUN_MSEC	500
+#define BATCH		1000
+
+enum { GETENVID, PAGE_UNMAP, NBENCH };
+
+static const char *bench_name[NBENCH] = {
+	"getenvid", "page_unmap",
+};
+
+static void
+worker(int bench, unsigned int start, unsigned int stop)
+{
+	uint32_t ncall = 0;
+	int i;
+
+	while (sys_time_msec() < start)
+		;
+	while (sys_time_msec() < stop) {
+		for (i = 0; i < BATCH; i++)
+			if (bench == GETENVID)
+				sys_getenvid();
+			else
+				sys_page_unmap(0, UTEMP);
+		ncall += BATCH;
+	}
+	ipc_send(thisenv->env_parent_id, ncall, 0, 0);
+	exit();
+}
+
+// Run 'bench' on the first ncpu CPUs at once.
+// Returns the total number of calls per millisecond.
+static uint32_t
+run(int bench, int ncpu)
+{
+	unsigned int start, stop;
+	uint32_t total = 0;
+	envid_t who;
+	int i, r;
+
+	// Leave time for all the workers to get going
+	start = sys_time_msec() + 50;
+	stop = start + RUN_MSEC;
+	for (i = 0; i < ncpu; i++) {
+		if ((r = fork()) < 0)
+			panic("fork: %e", r);
+		if (r == 0)
+			worker(bench, start, stop);
+		if ((r = sys_env_set_affinity(r, 1 << i)) < 0)
+			panic("sys_env_set_affinity: %e", r);
+	}
+	sys_sleep_until(stop);
+	for (i = 0; i < ncpu; i++)
+		total += ipc_recv(&who, 0, 0);
+	return total / RUN_MSEC;
+}
+
+void
+umain(int argc, char **argv)
+{
+	int bench, n, ncpu;
+	uint32_t calls;
+
+	// There is no call to count the CPUs, but restricting ourselves
+	// to a CPU that doesn't exist fails.
+	for (ncpu = 0; ncpu < 32; ncpu++)
+		if (sys_env_set_affinity(0, 1 << ncpu) < 0)
+			break;
+	sys_env_set_affinity(0, ~0);
+
+	cprintf("syscall     cpus  calls/ms  per cpu\n");
+	for (bench = 0; bench < NBENCH; bench++)
+		for (n = 1; n <= ncpu; n *= 2) {
+			calls = run(bench, n);
+			cprintf("%-10s  %4d  %8u  %7u\n", bench_name[bench], n,
+				calls, calls / n);
+		}
+}
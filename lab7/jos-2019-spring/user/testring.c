@@ -0,0 +1,69 @@
+// Test asynchronous system calls through the syscall ring.
+
+#include <inc/lib.h>
+
+#define NPAGE	32
+
+static int32_t results[NPAGE];
+static int nresult;
+
+// Collect completions into results[], indexed by their data.
+static void
+reap(void)
+{
+	uint32_t data;
+	int32_t result;
+
+	while (ring_reap(&data, &result)) {
+		assert(data < NPAGE);
+		results[data] = result;
+		nresult++;
+	}
+}
+
+void
+umain(int argc, char **argv)
+{
+	unsigned int stop;
+	int i, r;
+
+	// Queue page allocations and let the timer interrupt make them,
+	// falling back to sys_ring_enter if no timer interrupt comes
+	for (i = 0; i < NPAGE; i++)
+		if ((r = ring_submit(SYS_page_alloc, 0, (uint32_t)UTEMP + i * PGSIZE,
+				     PTE_P | PTE_U | PTE_W, 0, 0, i)) < 0)
+			panic("ring_submit: %e", r);
+	stop = sys_time_msec() + 1000;
+	while (nresult < NPAGE && sys_time_msec() < stop)
+		reap();
+	cprintf("%d of %d calls made on timer interrupts\n", nresult, NPAGE);
+	sys_ring_enter();
+	reap();
+	assert(nresult == NPAGE);
+	for (i = 0; i < NPAGE; i++) {
+		assert(results[i] == 0);
+		assert(uvpt[PGNUM(UTEMP + i * PGSIZE)] & PTE_P);
+	}
+
+	// Unmap them again, and send to ourselves while we are not
+	// receiving, which fails without blocking
+	nresult = 0;
+	for (i = 0; i < NPAGE - 1; i++)
+		if ((r = ring_submit(SYS_page_unmap, 0, (uint32_t)UTEMP + i * PGSIZE,
+				     0, 0, 0, i)) < 0)
+			panic("ring_submit: %e", r);
+	if ((r = ring_submit(SYS_ipc_try_send, thisenv->env_id, 0, 0, 0, 0,
+			     NPAGE - 1)) < 0)
+		panic("ring_submit: %e", r);
+	if ((r = sys_ring_enter()) != NPAGE)
+		panic("sys_ring_enter made %d calls, not %d", r, NPAGE);
+	reap();
+	assert(nresult == NPAGE);
+	for (i = 0; i < NPAGE - 1; i++) {
+		assert(results[i] == 0);
+		assert(!(uvpt[PGNUM(UTEMP + i * PGSIZE)] & PTE_P));
+	}
+	assert(results[NPAGE - 1] == -E_IPC_NOT_RECV);
+
+	cprintf("testring OK\n");
+}
@@ -0,0 +1,57 @@
+// Measure what it costs to enter and leave the kernel: a system call
+// on the fast path, one on the slow path, and a page fault reflected
+// to a user handler.  All of them save the user's registers in a
+// Trapframe and restore them on the way out.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NITER	100000
+
+extern char fault_resume[];
+
+static void
+handler(struct UTrapframe *utf)
+{
+	utf->utf_eip = (uintptr_t)fault_resume;
+}
+
+// Read from address 0, which is never mapped.  handler resumes us
+// right after the read.
+static void __attribute__((noinline))
+fault(void)
+{
+	asm volatile("movl 0, %%eax\n"
+		     ".globl fault_resume\n"
+		     "fault_resume:\n"
+		     : : : "eax", "memory");
+}
+
+void
+umain(int argc, char **argv)
+{
+	uint64_t start;
+	int i;
+
+	set_pgfault_handler(handler);
+
+	start = read_tsc();
+	for (i = 0; i < NITER; i++)
+		sys_getenvid();
+	cprintf("getenvid:          %u cycles\n",
+		(uint32_t)((read_tsc() - start) / NITER));
+
+	// Unmapping a page that isn't mapped is a no-op, but it goes
+	// through the whole of syscall()
+	start = read_tsc();
+	for (i = 0; i < NITER; i++)
+		sys_page_unmap(0, UTEMP);
+	cprintf("page_unmap (none): %u cycles\n",
+		(uint32_t)((read_tsc() - start) / NITER));
+
+	start = read_tsc();
+	for (i = 0; i < NITER; i++)
+		fault();
+	cprintf("page fault:        %u cycles\n",
+		(uint32_t)((read_tsc() - start) / NITER));
+}